@@ -3,8 +3,8 @@
 # on instance-5: <this script> 34.102.79.216
 # on instance-6: <this script> 34.125.29.150
 
-# Delete data file if it exists
-[ -f fs_1 ] && rm fs_1
+# Delete data file (with its superblock, journal and dirty map) if it exists
+rm -f fs_1 fs_1.super fs_1.journal.0 fs_1.journal.1 fs_1.dirty
 
 while true; do
     echo "Starting server (backup)"
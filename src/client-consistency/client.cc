@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <grpcpp/grpcpp.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
@@ -25,6 +26,8 @@ using blockstorageproto::BlockStorage;
 using blockstorageproto::PingMessage;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
+using blockstorageproto::StreamAck;
+using blockstorageproto::StreamWrite;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
 using grpc::Channel;
@@ -84,6 +87,50 @@ class BlockStorageClient {
         } while (!status.ok());
     }
 
+    // Write many blocks over one WriteStream, all in flight at once.
+    // Blocks the stream fails to acknowledge are retried one by one with Write.
+    void WritePipelined(const std::vector<uint64_t> &addresses, const std::vector<std::string> &blocks) {
+        std::vector<bool> acked(addresses.size(), false);
+        {
+            ClientContext context;
+            auto stream = use_backup ? stub_backup->WriteStream(&context) : stub_primary->WriteStream(&context);
+
+            std::thread reader([&] {
+                StreamAck ack;
+                while (stream->Read(&ack)) {
+                    if (ack.code() != 0) {
+                        continue;
+                    }
+                    for (auto seq : ack.seq()) {
+                        // Ignore acks for writes we never sent
+                        if (seq < acked.size()) {
+                            acked[seq] = true;
+                        }
+                    }
+                }
+            });
+
+            for (size_t i = 0; i < addresses.size(); i++) {
+                StreamWrite write;
+                write.set_seq(i);
+                write.set_address(addresses[i]);
+                write.set_data(blocks[i]);
+                if (!stream->Write(write)) {
+                    break;
+                }
+            }
+            stream->WritesDone();
+            reader.join();
+            stream->Finish();
+        }
+
+        for (size_t i = 0; i < addresses.size(); i++) {
+            if (!acked[i]) {
+                Write(addresses[i], blocks[i].data(), blocks[i].size());
+            }
+        }
+    }
+
     void Read(uint64_t address, char *buffer, size_t n) {
         if (n != BLOCK_SIZE) {
             throw std::runtime_error("Block size should be " + std::to_string(BLOCK_SIZE) + " (was " + std::to_string(n) + ")");
@@ -110,6 +157,11 @@ class BlockStorageClient {
             }
         } while (!status.ok());
 
+        if (reply.zero()) {
+            // All-zero blocks come back flagged rather than spelled out
+            memset(buffer, 0, n);
+            return;
+        }
         auto data_str = reply.data();
 
         if (data_str.length() != BLOCK_SIZE) {
@@ -234,6 +286,39 @@ void readWriteBenchmark(BlockStorageClient &client, std::vector<std::string> &ra
     //  cout << "time spent on 100 4KB reads  " << duration.count() << " ms." << endl;
 }
 
+// Same writes as a run of blocking Writes, then pipelined over one WriteStream
+void pipelineBenchmark(BlockStorageClient &client, int count) {
+    std::vector<uint64_t> addresses;
+    std::vector<std::string> blocks;
+    for (int i = 0; i < count; i++) {
+        addresses.push_back((uint64_t)i * BLOCK_SIZE);
+        blocks.push_back(strRand(BLOCK_SIZE));
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < count; i++) {
+        client.Write(addresses[i], blocks[i].data(), BLOCK_SIZE);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> duration = end - start;
+    cout << "time spent on " << count << " blocking writes  " << duration.count() << " ms." << endl;
+
+    start = std::chrono::high_resolution_clock::now();
+    client.WritePipelined(addresses, blocks);
+    end = std::chrono::high_resolution_clock::now();
+    duration = end - start;
+    cout << "time spent on " << count << " pipelined writes  " << duration.count() << " ms." << endl;
+
+    int mismatched = 0;
+    for (int i = 0; i < count; i++) {
+        char buffer_out[BLOCK_SIZE] = {};
+        client.Read(addresses[i], buffer_out, BLOCK_SIZE);
+        if (std::string(buffer_out, BLOCK_SIZE) != blocks[i]) {
+            mismatched++;
+        }
+    }
+    cout << mismatched << " of " << count << " blocks don't match" << endl;
+}
 
 void run_main(BlockStorageClient *client, uint64_t prep, uint64_t target) {
     for (int i = 0; i < 10; i++) {
@@ -374,6 +459,7 @@ int main(int argc, char **argv) {
         case 3: seq3(&client);break;
         case 4: seq4(&client);break;
         case 5: seq5(&client);break;
+        case 6: pipelineBenchmark(client, 1000);break;
         default: return 1;
     }
     
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <grpcpp/grpcpp.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
@@ -110,6 +111,11 @@ class BlockStorageClient {
             }
         } while (!status.ok());
 
+        if (reply.zero()) {
+            // All-zero blocks come back flagged rather than spelled out
+            memset(buffer, 0, n);
+            return;
+        }
         auto data_str = reply.data();
 
         if (data_str.length() != BLOCK_SIZE) {
@@ -0,0 +1,39 @@
+#include "AlignedBufferPool.hh"
+
+#include <stdlib.h>
+
+#include <new>
+
+#include "../shared/CommonDefinitions.hh"
+
+AlignedBufferPool::AlignedBufferPool(size_t count, size_t bufferSize) : bufferSize(bufferSize) {
+    void *mem = nullptr;
+    if (posix_memalign(&mem, BLOCK_SIZE, count * bufferSize) != 0) {
+        throw std::bad_alloc();
+    }
+    arena = static_cast<char *>(mem);
+    freeList.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        freeList.push_back(arena + i * bufferSize);
+    }
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+    free(arena);
+}
+
+char *AlignedBufferPool::take() {
+    std::unique_lock lock(mtx);
+    available.wait(lock, [this] { return !freeList.empty(); });
+    auto buf = freeList.back();
+    freeList.pop_back();
+    return buf;
+}
+
+void AlignedBufferPool::give(char *buf) {
+    {
+        std::lock_guard lock(mtx);
+        freeList.push_back(buf);
+    }
+    available.notify_one();
+}
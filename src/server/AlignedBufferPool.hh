@@ -0,0 +1,44 @@
+#ifndef ALIGNEDBUFFERPOOL_HH
+#define ALIGNEDBUFFERPOOL_HH
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Fixed set of BLOCK_SIZE-aligned buffers for O_DIRECT I/O.
+// All memory is allocated up front; acquire() blocks while every buffer is
+// leased out, so the footprint is exactly count * bufferSize.
+class AlignedBufferPool {
+    size_t bufferSize;
+    char *arena = nullptr;
+    std::vector<char *> freeList;
+    std::mutex mtx;
+    std::condition_variable available;
+
+    char *take();
+    void give(char *buf);
+
+   public:
+    class Lease {
+        AlignedBufferPool *pool;
+        char *buf;
+
+       public:
+        Lease(AlignedBufferPool *pool) : pool(pool), buf(pool->take()) {}
+        ~Lease() { pool->give(buf); }
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        char *data() { return buf; }
+    };
+
+    AlignedBufferPool(size_t count, size_t bufferSize);
+    ~AlignedBufferPool();
+    AlignedBufferPool(const AlignedBufferPool &) = delete;
+    AlignedBufferPool &operator=(const AlignedBufferPool &) = delete;
+
+    Lease acquire() { return Lease(this); }
+};
+
+#endif
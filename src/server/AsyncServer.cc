@@ -0,0 +1,279 @@
+#include "AsyncServer.hh"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <algorithm>
+#include <optional>
+#include <iostream>
+#include <stdexcept>
+
+using blockstorageproto::Ack;
+using blockstorageproto::BackupWriteRequest;
+using blockstorageproto::CompareTreeRequest;
+using blockstorageproto::CompareTreeResponse;
+using blockstorageproto::FinishSyncRequest;
+using blockstorageproto::HeartbeatMessage;
+using blockstorageproto::PingMessage;
+using blockstorageproto::ReadBatchRequest;
+using blockstorageproto::ReadBatchResponse;
+using blockstorageproto::ReadRequest;
+using blockstorageproto::ReadResponse;
+using blockstorageproto::TriggerSyncRequest;
+using blockstorageproto::WriteBatchRequest;
+using blockstorageproto::WriteRequest;
+using blockstorageproto::WriteResponse;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerCompletionQueue;
+using grpc::ServerContext;
+using grpc::Status;
+
+// The listening calls of one unary method on one queue.
+// Calls that have sent their response wait here to take a later RPC.
+// Only the queue's poller touches `spare`, so it needs no lock.
+template <class Req, class Res>
+class UnaryMethod : public AsyncServer::Method {
+   public:
+    typedef std::function<void(AsyncServer::Service *, ServerContext *, Req *, ServerAsyncResponseWriter<Res> *, grpc::CompletionQueue *, ServerCompletionQueue *, void *)> Requester;
+    typedef std::function<void(ServerContext *, const Req *, Res *, std::function<void(Status)>)> Handler;
+
+    AsyncServer *server;
+    AsyncServer::Service *service;
+    ServerCompletionQueue *cq;
+    Requester request;
+    Handler handle;
+    std::vector<AsyncServer::Call *> spare;
+
+    UnaryMethod(AsyncServer *server, AsyncServer::Service *service, ServerCompletionQueue *cq, Requester request, Handler handle)
+        : server(server), service(service), cq(cq), request(request), handle(handle) {}
+    ~UnaryMethod() {
+        for (auto call : spare) {
+            delete call;
+        }
+    }
+
+    // Put one more call to listening, reusing a spare one if there is any
+    void Listen();
+};
+
+// One unary RPC, from being requested on a queue until its response is sent.
+// When a request arrives it first puts a replacement to listening, so the
+// method keeps listening, then queues itself for a handler thread. The handler
+// reports the status through a callback, which may run on yet another thread.
+// Once the response is sent, the call goes back to its method's spares.
+// The messages live on the call's arena and are cleared, not freed, between
+// RPCs, so their 4 KiB payloads keep their buffers from one request to the
+// next; a call that has served once allocates nothing more.
+template <class Req, class Res>
+class UnaryCall : public AsyncServer::Call {
+    UnaryMethod<Req, Res> *method;
+
+    // Enough for both messages and their string headers
+    alignas(8) char initialBlock[1024];
+    google::protobuf::Arena arena;
+    Req *req;
+    Res *res;
+
+    // A ServerContext serves a single RPC, so these are rebuilt in place each time
+    std::optional<ServerContext> context;
+    std::optional<ServerAsyncResponseWriter<Res>> responder;
+    bool finishing = false;
+
+    static google::protobuf::ArenaOptions ArenaFor(char *block, size_t size) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = size;
+        return options;
+    }
+
+   public:
+    UnaryCall(UnaryMethod<Req, Res> *method) : method(method), arena(ArenaFor(initialBlock, sizeof(initialBlock))) {
+        req = google::protobuf::Arena::CreateMessage<Req>(&arena);
+        res = google::protobuf::Arena::CreateMessage<Res>(&arena);
+    }
+
+    void Listen() {
+        finishing = false;
+        context.emplace();
+        responder.emplace(&*context);
+        method->request(method->service, &*context, req, &*responder, method->cq, method->cq, this);
+    }
+
+    void Proceed(bool ok) override {
+        if (finishing) {
+            // Response sent (or the client went away): keep the call for a later RPC
+            responder.reset();
+            context.reset();
+            req->Clear();
+            res->Clear();
+            method->spare.push_back(this);
+            return;
+        }
+        if (!ok) {
+            // The queue is shutting down
+            delete this;
+            return;
+        }
+
+        method->Listen();
+        finishing = true;
+        method->server->Dispatch(this);
+    }
+
+    void Handle() override {
+        method->handle(&*context, req, res, [this](Status status) { responder->Finish(*res, status, this); });
+    }
+};
+
+template <class Req, class Res>
+void UnaryMethod<Req, Res>::Listen() {
+    UnaryCall<Req, Res> *call;
+    if (spare.empty()) {
+        call = new UnaryCall<Req, Res>(this);
+    } else {
+        call = static_cast<UnaryCall<Req, Res> *>(spare.back());
+        spare.pop_back();
+    }
+    call->Listen();
+}
+
+// Adapts a synchronous handler, which finishes its call before returning
+template <class Req, class Res>
+static typename UnaryMethod<Req, Res>::Handler Blocking(BlockStorage::Service *handler, Status (BlockStorage::Service::*method)(ServerContext *, const Req *, Res *)) {
+    return [handler, method](ServerContext *context, const Req *req, Res *res, std::function<void(Status)> done) {
+        done((handler->*method)(context, req, res));
+    };
+}
+
+AsyncServer::AsyncServer(PairedServer *handler, size_t queues, size_t handlerThreads)
+    : handler(handler), service(handler), numQueues(queues), numWorkers(std::max<size_t>(1, handlerThreads)) {
+    if (numQueues == 0) {
+        numQueues = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+AsyncServer::~AsyncServer() {
+    if (server) {
+        server->Shutdown();
+    }
+    // Let the queued handlers finish their calls while the queues still take the responses
+    {
+        std::lock_guard lock(workMutex);
+        stopping = true;
+    }
+    workReady.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (auto &cq : queues) {
+        cq->Shutdown();
+    }
+    for (auto &poller : pollers) {
+        poller.join();
+    }
+    // Only now are the pollers done with the spare calls
+    methods.clear();
+}
+
+// Start listening for one method on a queue
+template <class Req, class Res>
+static AsyncServer::Method *Serve(AsyncServer *server, AsyncServer::Service *service, ServerCompletionQueue *cq, typename UnaryMethod<Req, Res>::Requester request, typename UnaryMethod<Req, Res>::Handler handle) {
+    auto method = new UnaryMethod<Req, Res>(server, service, cq, request, handle);
+    for (int i = 0; i < ASYNC_CALLS_PER_QUEUE; i++) {
+        method->Listen();
+    }
+    return method;
+}
+
+void AsyncServer::Listen(ServerCompletionQueue *cq) {
+    BlockStorage::Service *h = handler;
+    auto paired = handler;
+    auto add = [this](Method *method) { methods.emplace_back(method); };
+
+    add(Serve<PingMessage, PingMessage>(this, &service, cq, &Service::RequestPing, Blocking(h, &BlockStorage::Service::Ping)));
+    add(Serve<ReadRequest, ReadResponse>(this, &service, cq, &Service::RequestRead, Blocking(h, &BlockStorage::Service::Read)));
+    add(Serve<WriteRequest, WriteResponse>(this, &service, cq, &Service::RequestWrite,
+        [paired](ServerContext *context, const WriteRequest *req, WriteResponse *res, std::function<void(Status)> done) {
+            paired->WriteAsync(context, req, res, std::move(done));
+        }));
+    add(Serve<HeartbeatMessage, HeartbeatMessage>(this, &service, cq, &Service::RequestHeartbeat, Blocking(h, &BlockStorage::Service::Heartbeat)));
+    add(Serve<BackupWriteRequest, Ack>(this, &service, cq, &Service::RequestBackupWrite, Blocking(h, &BlockStorage::Service::BackupWrite)));
+    add(Serve<TriggerSyncRequest, Ack>(this, &service, cq, &Service::RequestTriggerSync, Blocking(h, &BlockStorage::Service::TriggerSync)));
+    add(Serve<FinishSyncRequest, Ack>(this, &service, cq, &Service::RequestFinishSync, Blocking(h, &BlockStorage::Service::FinishSync)));
+    add(Serve<ReadBatchRequest, ReadBatchResponse>(this, &service, cq, &Service::RequestReadBatch, Blocking(h, &BlockStorage::Service::ReadBatch)));
+    add(Serve<WriteBatchRequest, WriteResponse>(this, &service, cq, &Service::RequestWriteBatch,
+        [paired](ServerContext *context, const WriteBatchRequest *req, WriteResponse *res, std::function<void(Status)> done) {
+            paired->WriteBatchAsync(context, req, res, std::move(done));
+        }));
+    add(Serve<WriteBatchRequest, Ack>(this, &service, cq, &Service::RequestBackupWriteBatch, Blocking(h, &BlockStorage::Service::BackupWriteBatch)));
+    add(Serve<CompareTreeRequest, CompareTreeResponse>(this, &service, cq, &Service::RequestCompareTree, Blocking(h, &BlockStorage::Service::CompareTree)));
+}
+
+void AsyncServer::Poll(ServerCompletionQueue *cq, int core) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        std::cerr << "Failed to pin poller to core " << core << ": " << strerror(err) << std::endl;
+    }
+
+    void *tag;
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+        static_cast<Call *>(tag)->Proceed(ok);
+    }
+}
+
+void AsyncServer::Dispatch(Call *call) {
+    {
+        std::lock_guard lock(workMutex);
+        work.push_back(call);
+    }
+    workReady.notify_one();
+}
+
+void AsyncServer::Work() {
+    while (true) {
+        Call *call;
+        {
+            std::unique_lock lock(workMutex);
+            workReady.wait(lock, [this] { return stopping || !work.empty(); });
+            if (work.empty()) {
+                return;
+            }
+            call = work.front();
+            work.pop_front();
+        }
+        call->Handle();
+    }
+}
+
+void AsyncServer::Start(std::string server_address) {
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    for (size_t i = 0; i < numQueues; i++) {
+        queues.push_back(builder.AddCompletionQueue());
+    }
+    server = builder.BuildAndStart();
+    if (!server) {
+        throw std::runtime_error("Failed to start server on " + server_address);
+    }
+
+    for (size_t i = 0; i < numWorkers; i++) {
+        workers.emplace_back([this] { Work(); });
+    }
+
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < numQueues; i++) {
+        auto cq = queues[i].get();
+        Listen(cq);
+        pollers.emplace_back([this, cq, i, cores] { Poll(cq, i % cores); });
+    }
+}
+
+void AsyncServer::Wait() {
+    server->Wait();
+}
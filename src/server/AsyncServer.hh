@@ -0,0 +1,129 @@
+#ifndef ASYNCSERVER_HH
+#define ASYNCSERVER_HH
+
+#include <grpcpp/grpcpp.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../cmake/build/blockstorage.grpc.pb.h"
+#include "PairedServer.hh"
+
+// Outstanding listening calls per method on each completion queue.
+// Extra RPCs that arrive meanwhile are queued by gRPC, not rejected.
+#define ASYNC_CALLS_PER_QUEUE 16
+// Threads that run the handlers. A handler can wait on the disk (a group
+// commit's fdatasync) or the partner, so this is also how many writers can
+// share one commit.
+#define ASYNC_HANDLER_THREADS 64
+
+// Serves the BlockStorage service from completion queues rather than gRPC's
+// synchronous thread pool. Each queue is drained by one poller thread pinned
+// to a core, which only moves calls along: an RPC that lands on its queue is
+// handed to a fixed pool of handler threads, and the poller goes back to the
+// queue. Handlers may block on storage; those that wait on the partner (the
+// primary's Write) finish their call from the client completion instead, so
+// no thread is held while the backup is in flight. The number of threads is
+// fixed, however many RPCs are outstanding.
+class AsyncServer {
+   public:
+    typedef BlockStorage::WithAsyncMethod_Ping<
+        BlockStorage::WithAsyncMethod_Read<
+        BlockStorage::WithAsyncMethod_Write<
+        BlockStorage::WithAsyncMethod_Heartbeat<
+        BlockStorage::WithAsyncMethod_BackupWrite<
+        BlockStorage::WithAsyncMethod_TriggerSync<
+        BlockStorage::WithAsyncMethod_FinishSync<
+        BlockStorage::WithAsyncMethod_ReadBatch<
+        BlockStorage::WithAsyncMethod_WriteBatch<
+        BlockStorage::WithAsyncMethod_BackupWriteBatch<
+        BlockStorage::WithAsyncMethod_CompareTree<
+        BlockStorage::Service>>>>>>>>>>> UnaryAsyncService;
+
+    // Unary RPCs are served from the completion queues. Streaming RPCs are
+    // long-lived bulk transfers, so they stay on gRPC's sync API and are
+    // forwarded to the handler; each holds a sync-pool thread while open.
+    class Service : public UnaryAsyncService {
+        BlockStorage::Service *handler;
+
+       public:
+        Service(BlockStorage::Service *handler) : handler(handler) {}
+
+        grpc::Status ReadExtent(grpc::ServerContext *context, const blockstorageproto::ExtentRequest *req, grpc::ServerWriter<blockstorageproto::ExtentChunk> *writer) override {
+            return handler->ReadExtent(context, req, writer);
+        }
+        grpc::Status WriteExtent(grpc::ServerContext *context, grpc::ServerReader<blockstorageproto::ExtentChunk> *reader, blockstorageproto::WriteResponse *res) override {
+            return handler->WriteExtent(context, reader, res);
+        }
+        grpc::Status BackupWriteExtent(grpc::ServerContext *context, grpc::ServerReader<blockstorageproto::ExtentChunk> *reader, blockstorageproto::Ack *res) override {
+            return handler->BackupWriteExtent(context, reader, res);
+        }
+        grpc::Status WriteStream(grpc::ServerContext *context, grpc::ServerReaderWriter<blockstorageproto::StreamAck, blockstorageproto::StreamWrite> *stream) override {
+            return handler->WriteStream(context, stream);
+        }
+        grpc::Status Replicate(grpc::ServerContext *context, grpc::ServerReaderWriter<blockstorageproto::ReplicationAck, blockstorageproto::ReplicationBatch> *stream) override {
+            return handler->Replicate(context, stream);
+        }
+        grpc::Status SyncStream(grpc::ServerContext *context, grpc::ServerReader<blockstorageproto::SyncFrame> *reader, blockstorageproto::Ack *res) override {
+            return handler->SyncStream(context, reader, res);
+        }
+    };
+
+    // Base for per-RPC state; its address is the completion queue tag
+    class Call {
+       public:
+        virtual ~Call() {}
+        virtual void Proceed(bool ok) = 0;
+        // Run the handler; called on a handler thread
+        virtual void Handle() = 0;
+    };
+
+    // Base for the per-queue state of one method, which owns its idle calls
+    class Method {
+       public:
+        virtual ~Method() {}
+    };
+
+   private:
+    PairedServer *handler;
+    Service service;
+    std::unique_ptr<grpc::Server> server;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> queues;
+    std::vector<std::thread> pollers;
+    std::vector<std::unique_ptr<Method>> methods;
+    size_t numQueues;
+
+    // Calls waiting for a handler thread
+    std::vector<std::thread> workers;
+    std::mutex workMutex;
+    std::condition_variable workReady;
+    std::deque<Call *> work;
+    bool stopping = false;
+    size_t numWorkers;
+
+    void Listen(grpc::ServerCompletionQueue *cq);
+    void Poll(grpc::ServerCompletionQueue *cq, int core);
+    void Work();
+
+   public:
+    // queues == 0 picks one queue per core
+    AsyncServer(PairedServer *handler, size_t queues, size_t handlerThreads = ASYNC_HANDLER_THREADS);
+    ~AsyncServer();
+
+    // Queue a call for the handler threads
+    void Dispatch(Call *call);
+
+    // Start serving on the given address; pollers run in the background
+    void Start(std::string server_address);
+    // Block until the server shuts down
+    void Wait();
+    size_t queue_count() { return numQueues; }
+};
+
+#endif
@@ -18,10 +18,12 @@
 
 #include "../cmake/build/blockstorage.grpc.pb.h"
 #include "../shared/CommonDefinitions.hh"
+#include "ContentIndex.hh"
 #include "FileStorage.hh"
 #include "HeartbeatHelper.hh"
 #include "PairedServer.hh"
 #include "ReplicationModule.hh"
+#include "ZeroBlock.hh"
 
 namespace fs = std::filesystem;
 using blockstorageproto::Ack;
@@ -32,7 +34,6 @@ using blockstorageproto::HeartbeatMessage;
 using blockstorageproto::PingMessage;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
-using blockstorageproto::SyncBlockRequest;
 using blockstorageproto::TriggerSyncRequest;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
@@ -73,9 +74,7 @@ Status BackupServer::Read(ServerContext *context, const ReadRequest *req, ReadRe
     }
 
     // We are standalone, so process the req locally
-    char buffer[BLOCK_SIZE];
-    storage->read_data(req->address(), buffer);
-    res->set_data(string(buffer, BLOCK_SIZE));
+    ReadBlockLocal(req->address(), res);
     return Status::OK;
 }
 
@@ -89,17 +88,17 @@ Status BackupServer::Write(ServerContext *context, const WriteRequest *req, Writ
     }
 
     // We are standalone, so process the req locally and mark it for use in recovery later
-    auto data_str = req->data();
+    const auto &data = req->data();
 
     // Sanity check
-    if (data_str.length() != BLOCK_SIZE) {
-        return Status(StatusCode::INVALID_ARGUMENT, "Block size should be " + std::to_string(BLOCK_SIZE) + " (was " + std::to_string(data_str.length()) + ")");
+    auto check = CheckBlockSize(data);
+    if (!check.ok()) {
+        return check;
     }
 
     auto address = req->address();
-    auto data = data_str.c_str();
 
-    storage->write_data(address, data);
+    replication->WriteDirty({address}, [&] { storage->write_from(address, data); });
 
 #ifdef INCLUDE_CRASH_POINTS
     if (address == PREP_CRASH_ON_MESSAGE_BACKUP) {
@@ -113,8 +112,6 @@ Status BackupServer::Write(ServerContext *context, const WriteRequest *req, Writ
     }
 #endif
 
-    replication->MarkDirty(address);
-
 #ifdef INCLUDE_CRASH_POINTS
     if (crash_flag && address == CRASH_PRIMARY_AFTER_WRITE) {
         crash_after(1);
@@ -126,6 +123,12 @@ Status BackupServer::Write(ServerContext *context, const WriteRequest *req, Writ
 
 Status BackupServer::BackupWrite(ServerContext *context, const BackupWriteRequest *req, Ack *res) {
     auto address = req->address();
+    const auto &data = req->zero() ? ZeroBlock() : req->data();
+
+    auto check = CheckBlockSize(data);
+    if (!check.ok()) {
+        return check;
+    }
     
 #ifdef INCLUDE_CRASH_POINTS
     if (address == PREP_CRASH_ON_MESSAGE_BACKUP) {
@@ -139,7 +142,7 @@ Status BackupServer::BackupWrite(ServerContext *context, const BackupWriteReques
     switch (SafeGetState()) {
         case ReplState::Normal:
             // Commit data to disk
-            storage->write_data(address, req->data().c_str());
+            storage->write_from(address, data);
 
 #ifdef INCLUDE_CRASH_POINTS
             if (crash_flag && address == CRASH_BACKUP_DURING_BACKUP) {
@@ -162,6 +165,151 @@ Status BackupServer::BackupWrite(ServerContext *context, const BackupWriteReques
     }
 }
 
+Status BackupServer::ReadBatch(ServerContext *context, const ReadBatchRequest *req, ReadBatchResponse *res) {
+    if (SafeGetState() != ReplState::Standalone) {
+        // Redirect client to the primary unless we're standalone
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+    return ReadBatchLocal(req, res);
+}
+
+Status BackupServer::WriteBatch(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res) {
+    // Hold the state for the whole batch, as in Write
+    std::shared_lock lock(stateMutex);
+    if (repl_state != ReplState::Standalone) {
+        // Redirect client to the primary unless we're Standalone
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+
+    auto check = CheckBatch(*req);
+    if (!check.ok()) {
+        return check;
+    }
+
+    std::vector<uint64_t> addresses;
+    for (const auto &write : req->writes()) {
+        addresses.push_back(write.address());
+    }
+    replication->WriteDirty(addresses, [&] { WriteBatchLocal(req); });
+    return Status::OK;
+}
+
+Status BackupServer::BackupWriteBatch(ServerContext *context, const WriteBatchRequest *req, Ack *res) {
+    auto check = CheckBatch(*req);
+    if (!check.ok()) {
+        return check;
+    }
+
+    switch (SafeGetState()) {
+        case ReplState::Normal:
+            WriteBatchLocal(req);
+            return Status::OK;
+        case ReplState::Standalone:
+            cout << "Assumption violated: Backup node received a replication message while acting as standalone." << endl;
+            cout << "Both nodes are servicing client reqs. This suggests that a network partition has occurred." << endl;
+            exit(1);
+        case ReplState::Recovering:
+            // As in BackupWrite: fail, sending the primary into Standalone
+            return Status(StatusCode::UNAVAILABLE, "recovering");
+        default:
+            throw std::runtime_error("Invalid enum value");
+    }
+}
+
+Status BackupServer::ReadExtent(ServerContext *context, const ExtentRequest *req, ServerWriter<ExtentChunk> *writer) {
+    if (SafeGetState() != ReplState::Standalone) {
+        // Redirect client to the primary unless we're standalone
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+    return ReadExtentLocal(req, writer);
+}
+
+Status BackupServer::WriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, WriteResponse *res) {
+    // Hold the state for the whole extent, as in Write
+    std::shared_lock lock(stateMutex);
+    if (repl_state != ReplState::Standalone) {
+        // Redirect client to the primary unless we're Standalone
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+
+    return ReceiveExtent(reader, [this](std::vector<ExtentChunk> &run) {
+        replication->WriteDirty(RunBlocks(run), [&] { WriteExtentLocal(run); });
+    });
+}
+
+Status BackupServer::BackupWriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, Ack *res) {
+    switch (SafeGetState()) {
+        case ReplState::Normal:
+            return ReceiveExtent(reader, [this](std::vector<ExtentChunk> &run) { WriteExtentLocal(run); });
+        case ReplState::Standalone:
+            cout << "Assumption violated: Backup node received a replication message while acting as standalone." << endl;
+            cout << "Both nodes are servicing client reqs. This suggests that a network partition has occurred." << endl;
+            exit(1);
+        case ReplState::Recovering:
+            // As in BackupWrite: fail, sending the primary into Standalone
+            return Status(StatusCode::UNAVAILABLE, "recovering");
+        default:
+            throw std::runtime_error("Invalid enum value");
+    }
+}
+
+Status BackupServer::Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch> *stream) {
+    ReplicationBatch batch;
+    ReplicationAck ack;
+    uint64_t expected = 0;
+    // Mirrors the primary's index for this stream
+    ContentIndex content;
+
+    while (stream->Read(&batch)) {
+        auto check = ResolveContent(batch.mutable_writes(), &content);
+        if (!check.ok()) {
+            return check;
+        }
+        const auto &writes = batch.writes();
+        check = CheckBatch(writes);
+        if (!check.ok()) {
+            return check;
+        }
+        if (expected != 0 && batch.first_seq() != expected) {
+            return Status(StatusCode::INVALID_ARGUMENT, "expected write " + std::to_string(expected) + ", got " + std::to_string(batch.first_seq()));
+        }
+
+#ifdef INCLUDE_CRASH_POINTS
+        for (const auto &write : writes.writes()) {
+            if (write.address() == PREP_CRASH_ON_MESSAGE_BACKUP) {
+                crash_flag = true;
+            }
+            if (crash_flag && write.address() == CRASH_BACKUP_DURING_BACKUP) {
+                crash();
+            }
+        }
+#endif
+
+        switch (SafeGetState()) {
+            case ReplState::Normal:
+                // One commit covers every write in the message
+                WriteBatchLocal(&writes);
+                break;
+            case ReplState::Standalone:
+                cout << "Assumption violated: Backup node received a replication message while acting as standalone." << endl;
+                cout << "Both nodes are servicing client reqs. This suggests that a network partition has occurred." << endl;
+                exit(1);
+            case ReplState::Recovering:
+                // As in BackupWrite: fail, sending the primary into Standalone
+                return Status(StatusCode::UNAVAILABLE, "recovering");
+            default:
+                throw std::runtime_error("Invalid enum value");
+        }
+
+        expected = batch.first_seq() + writes.writes_size();
+        ack.set_seq(expected - 1);
+        if (!stream->Write(ack)) {
+            break;
+        }
+    }
+    return Status::OK;
+}
+
 void BackupServer::HandlePartnerRecovered() {
     PairedServer::HandlePartnerRecovered();
 
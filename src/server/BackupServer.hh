@@ -34,7 +34,6 @@ using blockstorageproto::HeartbeatMessage;
 using blockstorageproto::PingMessage;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
-using blockstorageproto::SyncBlockRequest;
 using blockstorageproto::TriggerSyncRequest;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
@@ -57,6 +56,13 @@ class BackupServer : public PairedServer {
     virtual Status Read(ServerContext *context, const ReadRequest *req, ReadResponse *res) override;
     virtual Status Write(ServerContext *context, const WriteRequest *req, WriteResponse *res) override;
     virtual Status BackupWrite(ServerContext *context, const BackupWriteRequest *req, Ack *res) override;
+    virtual Status ReadBatch(ServerContext *context, const ReadBatchRequest *req, ReadBatchResponse *res) override;
+    virtual Status WriteBatch(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res) override;
+    virtual Status BackupWriteBatch(ServerContext *context, const WriteBatchRequest *req, Ack *res) override;
+    virtual Status ReadExtent(ServerContext *context, const ExtentRequest *req, ServerWriter<ExtentChunk> *writer) override;
+    virtual Status WriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, WriteResponse *res) override;
+    virtual Status BackupWriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, Ack *res) override;
+    virtual Status Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch> *stream) override;
     
     virtual void HandlePartnerRecovered() override;
     
@@ -0,0 +1,98 @@
+#include "BlockCache.hh"
+
+#include <string.h>
+
+#include "../shared/CommonDefinitions.hh"
+
+BlockCache::BlockCache(size_t capacityBytes) : shards(new Shard[CACHE_SHARDS]) {
+    size_t perShard = capacityBytes / BLOCK_SIZE / CACHE_SHARDS;
+    if (perShard == 0) perShard = 1;
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        auto &shard = shards[i];
+        shard.capacity = perShard;
+        shard.keys.resize(perShard);
+        shard.referenced.resize(perShard);
+        shard.data.reset(new char[perShard * BLOCK_SIZE]);
+        shard.index.reserve(perShard);
+    }
+}
+
+BlockCache::Shard &BlockCache::shard_for(uint64_t block) {
+    // Mix the bits so strided access patterns still spread across shards
+    auto h = block * 0x9e3779b97f4a7c15ull;
+    return shards[(h >> 32) % CACHE_SHARDS];
+}
+
+bool BlockCache::lookup(uint64_t offset, char *out) {
+    if (offset % BLOCK_SIZE != 0) return false;
+    auto block = offset / BLOCK_SIZE;
+    auto &shard = shard_for(block);
+
+    {
+        std::lock_guard lock(shard.mtx);
+        auto it = shard.index.find(block);
+        if (it != shard.index.end()) {
+            shard.referenced[it->second] = true;
+            memcpy(out, shard.data.get() + (size_t)it->second * BLOCK_SIZE, BLOCK_SIZE);
+            hitCount++;
+            return true;
+        }
+    }
+    missCount++;
+    return false;
+}
+
+void BlockCache::put(uint64_t block, const char *in) {
+    auto &shard = shard_for(block);
+    std::lock_guard lock(shard.mtx);
+
+    uint32_t slot;
+    auto it = shard.index.find(block);
+    if (it != shard.index.end()) {
+        slot = it->second;
+    } else if (shard.used < shard.capacity) {
+        slot = shard.used++;
+        shard.index[block] = slot;
+        shard.keys[slot] = block;
+    } else {
+        // CLOCK: skip (and clear) recently referenced slots, evict the first cold one
+        while (shard.referenced[shard.hand]) {
+            shard.referenced[shard.hand] = false;
+            shard.hand = (shard.hand + 1) % shard.capacity;
+        }
+        slot = shard.hand;
+        shard.hand = (shard.hand + 1) % shard.capacity;
+        shard.index.erase(shard.keys[slot]);
+        shard.index[block] = slot;
+        shard.keys[slot] = block;
+    }
+    shard.referenced[slot] = true;
+    memcpy(shard.data.get() + (size_t)slot * BLOCK_SIZE, in, BLOCK_SIZE);
+}
+
+void BlockCache::erase(uint64_t block) {
+    auto &shard = shard_for(block);
+    std::lock_guard lock(shard.mtx);
+    auto it = shard.index.find(block);
+    if (it == shard.index.end()) return;
+
+    // Leave the slot cold so CLOCK reuses it next
+    shard.referenced[it->second] = false;
+    shard.keys[it->second] = UINT64_MAX;
+    shard.index.erase(it);
+}
+
+void BlockCache::insert(uint64_t offset, const char *in) {
+    if (offset % BLOCK_SIZE != 0) return;
+    put(offset / BLOCK_SIZE, in);
+}
+
+void BlockCache::update(uint64_t offset, const char *in) {
+    if (offset % BLOCK_SIZE == 0) {
+        put(offset / BLOCK_SIZE, in);
+        return;
+    }
+    erase(offset / BLOCK_SIZE);
+    erase(offset / BLOCK_SIZE + 1);
+}
@@ -0,0 +1,57 @@
+#ifndef BLOCKCACHE_HH
+#define BLOCKCACHE_HH
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define CACHE_SHARDS 64
+// How often the server logs hit/miss counters
+#define CACHE_REPORT_INTERVAL_S 60
+
+// In-memory cache of aligned blocks, split into independently locked shards,
+// each evicting with CLOCK (second chance).
+// Callers must hold the block's stripe lock (shared for lookup/insert,
+// exclusive for update) so a fill from disk can never race a newer write.
+// Requests at unaligned offsets are not cached; a write at an unaligned offset
+// invalidates the two blocks it overlaps.
+class BlockCache {
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<uint64_t, uint32_t> index;  // block number -> slot
+        std::vector<uint64_t> keys;
+        std::vector<bool> referenced;
+        std::unique_ptr<char[]> data;
+        uint32_t capacity = 0;
+        uint32_t used = 0;
+        uint32_t hand = 0;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+    std::atomic<uint64_t> hitCount{0};
+    std::atomic<uint64_t> missCount{0};
+
+    Shard &shard_for(uint64_t block);
+    void put(uint64_t block, const char *in);
+    void erase(uint64_t block);
+
+   public:
+    BlockCache(size_t capacityBytes);
+
+    // Copy the block at this offset into out if cached
+    bool lookup(uint64_t offset, char *out);
+    // Fill after a read miss
+    void insert(uint64_t offset, const char *in);
+    // Write-through after a write
+    void update(uint64_t offset, const char *in);
+
+    uint64_t hits() { return hitCount; }
+    uint64_t misses() { return missCount; }
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "BlockLockTable.hh"
+
+#include <algorithm>
+
+#include "../shared/CommonDefinitions.hh"
+
+void BlockLockTable::stripes_for(uint64_t offset, size_t *first, size_t *second) {
+    auto a = (offset / BLOCK_SIZE) % LOCK_STRIPES;
+    auto b = ((offset + BLOCK_SIZE - 1) / BLOCK_SIZE) % LOCK_STRIPES;
+    *first = a < b ? a : b;
+    *second = a < b ? b : a;
+}
+
+void BlockLockTable::lock(uint64_t offset) {
+    size_t a, b;
+    stripes_for(offset, &a, &b);
+    stripes[a].mtx.lock();
+    if (b != a) stripes[b].mtx.lock();
+}
+
+void BlockLockTable::unlock(uint64_t offset) {
+    size_t a, b;
+    stripes_for(offset, &a, &b);
+    if (b != a) stripes[b].mtx.unlock();
+    stripes[a].mtx.unlock();
+}
+
+void BlockLockTable::lock_shared(uint64_t offset) {
+    size_t a, b;
+    stripes_for(offset, &a, &b);
+    stripes[a].mtx.lock_shared();
+    if (b != a) stripes[b].mtx.lock_shared();
+}
+
+void BlockLockTable::unlock_shared(uint64_t offset) {
+    size_t a, b;
+    stripes_for(offset, &a, &b);
+    if (b != a) stripes[b].mtx.unlock_shared();
+    stripes[a].mtx.unlock_shared();
+}
+
+void BlockLockTable::lock_all() {
+    for (auto &s : stripes) s.mtx.lock();
+}
+
+void BlockLockTable::unlock_all() {
+    for (auto &s : stripes) s.mtx.unlock();
+}
+
+BlockLockTable::BatchGuard::BatchGuard(BlockLockTable &table, const std::vector<uint64_t> &offsets, bool shared) : table(table), shared(shared) {
+    for (auto offset : offsets) {
+        size_t a, b;
+        table.stripes_for(offset, &a, &b);
+        held.push_back(a);
+        held.push_back(b);
+    }
+    std::sort(held.begin(), held.end());
+    held.erase(std::unique(held.begin(), held.end()), held.end());
+
+    for (auto i : held) {
+        if (shared) {
+            table.stripes[i].mtx.lock_shared();
+        } else {
+            table.stripes[i].mtx.lock();
+        }
+    }
+}
+
+BlockLockTable::BatchGuard::~BatchGuard() {
+    for (auto it = held.rbegin(); it != held.rend(); it++) {
+        if (shared) {
+            table.stripes[*it].mtx.unlock_shared();
+        } else {
+            table.stripes[*it].mtx.unlock();
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef BLOCKLOCKTABLE_HH
+#define BLOCKLOCKTABLE_HH
+
+#include <stdint.h>
+
+#include <shared_mutex>
+#include <vector>
+
+#define LOCK_STRIPES 1024
+
+// Reader/writer locks striped by block index.
+// A request at an arbitrary offset covers at most two blocks; both stripes are
+// taken (in index order, so concurrent requests can't deadlock) for the duration
+// of the op. Reads of the same block share access, and requests touching
+// disjoint stripes proceed in parallel.
+class BlockLockTable {
+    struct alignas(64) Stripe {
+        std::shared_mutex mtx;
+    };
+    Stripe stripes[LOCK_STRIPES];
+
+    void stripes_for(uint64_t offset, size_t *first, size_t *second);
+
+   public:
+    void lock(uint64_t offset);
+    void unlock(uint64_t offset);
+    void lock_shared(uint64_t offset);
+    void unlock_shared(uint64_t offset);
+
+    // Exclusive access to the whole table (e.g. for re-initializing the file)
+    void lock_all();
+    void unlock_all();
+
+    class ReadGuard {
+        BlockLockTable &table;
+        uint64_t offset;
+
+       public:
+        ReadGuard(BlockLockTable &table, uint64_t offset) : table(table), offset(offset) { table.lock_shared(offset); }
+        ~ReadGuard() { table.unlock_shared(offset); }
+    };
+
+    class AllGuard {
+        BlockLockTable &table;
+
+       public:
+        AllGuard(BlockLockTable &table) : table(table) { table.lock_all(); }
+        ~AllGuard() { table.unlock_all(); }
+    };
+
+    // Every stripe covering a set of offsets, taken in index order, so a
+    // multi-block op is isolated from single-block ops and other batches
+    class BatchGuard {
+        BlockLockTable &table;
+        std::vector<size_t> held;
+        bool shared;
+
+       public:
+        BatchGuard(BlockLockTable &table, const std::vector<uint64_t> &offsets, bool shared);
+        ~BatchGuard();
+    };
+
+    class WriteGuard {
+        BlockLockTable &table;
+        uint64_t offset;
+
+       public:
+        WriteGuard(BlockLockTable &table, uint64_t offset) : table(table), offset(offset) { table.lock(offset); }
+        ~WriteGuard() { table.unlock(offset); }
+    };
+};
+
+#endif
@@ -0,0 +1,48 @@
+#include "ContentIndex.hh"
+
+#include <string.h>
+
+// Mixes a word at a time. Both ends must agree on it, so it is spelled out
+// here rather than left to std::hash.
+uint64_t ContentIndex::Hash(const char *data, size_t size) {
+    const uint64_t prime = 0x9e3779b97f4a7c15ull;
+    uint64_t h = size * prime;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * prime;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ (uint8_t)data[i]) * prime;
+    }
+    return h ^ (h >> 32);
+}
+
+uint64_t ContentIndex::Hash(const std::string &data) {
+    return Hash(data.data(), data.size());
+}
+
+const std::string *ContentIndex::Find(uint64_t hash) {
+    auto it = blocks.find(hash);
+    return it == blocks.end() ? nullptr : &it->second;
+}
+
+void ContentIndex::Insert(uint64_t hash, const std::string &data) {
+    auto [it, added] = blocks.try_emplace(hash);
+    it->second.assign(data);
+    if (!added) {
+        return;
+    }
+    order.push_back(hash);
+    if (order.size() > capacity) {
+        blocks.erase(order.front());
+        order.pop_front();
+    }
+}
+
+void ContentIndex::Clear() {
+    blocks.clear();
+    order.clear();
+}
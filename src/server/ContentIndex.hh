@@ -0,0 +1,41 @@
+#ifndef CONTENTINDEX_HH
+#define CONTENTINDEX_HH
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+// Distinct blocks remembered by each end of a replication stream or sync (16 MiB of data)
+#define CONTENT_INDEX_BLOCKS 4096
+
+// The most recent distinct block contents seen on one ordered channel (a
+// Replicate stream, or one sync), keyed by content hash. Both ends keep one
+// and feed it the same full blocks in the same order, so the two stay
+// identical without any messages of their own. The sender can then replace a
+// repeated block with its hash, knowing the receiver will find it.
+// The receiver holds the content itself rather than where it was written, so
+// a reference stays good whatever has been written over that block since.
+class ContentIndex {
+    size_t capacity;
+    std::unordered_map<uint64_t, std::string> blocks;
+    // Hashes in insertion order, oldest first
+    std::deque<uint64_t> order;
+
+   public:
+    ContentIndex(size_t capacity = CONTENT_INDEX_BLOCKS) : capacity(capacity) {}
+
+    static uint64_t Hash(const std::string &data);
+    static uint64_t Hash(const char *data, size_t size);
+
+    // Content remembered under this hash, or nullptr
+    const std::string *Find(uint64_t hash);
+    // Remember a full block, evicting the oldest one if full.
+    // A block whose hash is already present replaces it in place.
+    void Insert(uint64_t hash, const std::string &data);
+    void Clear();
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "DirtyBitmap.hh"
+
+#include <algorithm>
+
+#include "../shared/CommonDefinitions.hh"
+
+DirtyBitmap::DirtyBitmap(uint64_t volumeBytes)
+    : blockCount(volumeBytes / BLOCK_SIZE), wordCount((blockCount + 63) / 64), words(new std::atomic<uint64_t>[wordCount]()) {}
+
+bool DirtyBitmap::Mark(uint64_t address) {
+    auto first = address / BLOCK_SIZE;
+    auto last = (address + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    bool added = false;
+    for (auto block = first; block <= last && block < blockCount; block++) {
+        auto bit = 1ull << (block % 64);
+        // Skip the atomic write when the bit is already set, as it usually is for a busy block
+        if ((words[block / 64].load(std::memory_order_relaxed) & bit) == 0 &&
+            (words[block / 64].fetch_or(bit, std::memory_order_release) & bit) == 0) {
+            added = true;
+        }
+    }
+    return added;
+}
+
+void DirtyBitmap::MarkAll() {
+    for (size_t i = 0; i < wordCount; i++) {
+        auto end = std::min<uint64_t>(blockCount - i * 64, 64);
+        words[i].store(end == 64 ? ~0ull : (1ull << end) - 1, std::memory_order_relaxed);
+    }
+}
+
+bool DirtyBitmap::Take(size_t *cursor, std::vector<uint64_t> *blocks, size_t max) {
+    blocks->clear();
+    for (; *cursor < wordCount && blocks->size() < max; (*cursor)++) {
+        if (words[*cursor].load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        auto bits = words[*cursor].exchange(0, std::memory_order_acquire);
+        while (bits != 0) {
+            auto bit = __builtin_ctzll(bits);
+            blocks->push_back(((uint64_t)*cursor * 64 + bit) * BLOCK_SIZE);
+            bits &= bits - 1;
+        }
+    }
+    return !blocks->empty();
+}
+
+bool DirtyBitmap::IsMarked(uint64_t address) const {
+    auto block = address / BLOCK_SIZE;
+    return block < blockCount && (words[block / 64].load(std::memory_order_relaxed) >> (block % 64) & 1) != 0;
+}
+
+void DirtyBitmap::MoveInto(DirtyBitmap *other) {
+    for (size_t i = 0; i < wordCount && i < other->wordCount; i++) {
+        if (words[i].load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        other->words[i].fetch_or(words[i].exchange(0, std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+void DirtyBitmap::Merge(const DirtyBitmap &other) {
+    for (size_t i = 0; i < wordCount && i < other.wordCount; i++) {
+        auto bits = other.words[i].load(std::memory_order_relaxed);
+        if (bits != 0) {
+            words[i].fetch_or(bits, std::memory_order_relaxed);
+        }
+    }
+}
+
+void DirtyBitmap::Clear() {
+    for (size_t i = 0; i < wordCount; i++) {
+        words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+size_t DirtyBitmap::Count() const {
+    size_t count = 0;
+    for (size_t i = 0; i < wordCount; i++) {
+        count += __builtin_popcountll(words[i].load(std::memory_order_relaxed));
+    }
+    return count;
+}
+
+void DirtyBitmap::OrInto(std::vector<uint64_t> *image) const {
+    for (size_t i = 0; i < wordCount; i++) {
+        (*image)[i] |= words[i].load(std::memory_order_acquire);
+    }
+}
+
+void DirtyBitmap::Load(const std::vector<uint64_t> &image) {
+    for (size_t i = 0; i < wordCount && i < image.size(); i++) {
+        if (image[i] != 0) {
+            words[i].fetch_or(image[i], std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef DIRTYBITMAP_HH
+#define DIRTYBITMAP_HH
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// One bit per block of the volume (32 KiB for 1 GiB), so tracking costs the
+// same however many blocks change. Bits are set and taken with atomic word
+// operations, so writers never wait on each other or on a sync.
+// Blocks are aligned: a write at an unaligned address dirties both blocks it
+// straddles, and a sync sends them whole.
+class DirtyBitmap {
+    uint64_t blockCount;
+    size_t wordCount;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+   public:
+    DirtyBitmap(uint64_t volumeBytes);
+
+    // Mark the block(s) a write of one block at `address` touches; true if
+    // any was not marked already. Addresses past the end of the volume are not tracked.
+    bool Mark(uint64_t address);
+    void MarkAll();
+    // Clear the set bits from *cursor (a word index) on, appending the
+    // addresses of their blocks in order, until at least `max` are taken or
+    // the end is reached. Returns false once there was nothing left to take.
+    bool Take(size_t *cursor, std::vector<uint64_t> *blocks, size_t max);
+    bool IsMarked(uint64_t address) const;
+    // Set every bit that is set in `other`
+    void Merge(const DirtyBitmap &other);
+    // Move every set bit into `other`, leaving this empty (bar any set meanwhile)
+    void MoveInto(DirtyBitmap *other);
+    void Clear();
+    size_t Count() const;
+
+    // Raw words, for persisting (see DirtyMapFile)
+    size_t word_count() const { return wordCount; }
+    // OR the bits into `image`, which holds word_count() words
+    void OrInto(std::vector<uint64_t> *image) const;
+    // Set every bit that is set in `image`
+    void Load(const std::vector<uint64_t> &image);
+};
+
+#endif
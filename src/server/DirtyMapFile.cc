@@ -0,0 +1,130 @@
+#include "DirtyMapFile.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "../shared/CommonDefinitions.hh"
+
+#define DIRTY_MAP_MAGIC 0x59545244u  // "DRTY"
+#define DIRTY_MAP_VERSION 1
+
+struct DirtyMapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t generation;
+    uint64_t checksum;  // FNV-1a over the bitmap words
+};
+
+static uint64_t image_checksum(const std::vector<uint64_t> &image) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto bytes = reinterpret_cast<const unsigned char *>(image.data());
+    for (size_t i = 0; i < image.size() * sizeof(uint64_t); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+DirtyMapFile::DirtyMapFile(const std::string &fileName, uint64_t volumeSize, size_t wordCount)
+    : volumeSize(volumeSize), wordCount(wordCount) {
+    auto name = fileName + ".dirty";
+    fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open dirty map " + name + ": " + strerror(errno));
+    }
+    // Slots start on block boundaries
+    auto bytes = sizeof(DirtyMapHeader) + wordCount * sizeof(uint64_t);
+    slotSize = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+DirtyMapFile::~DirtyMapFile() {
+    {
+        std::lock_guard lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+    close(fd);
+}
+
+bool DirtyMapFile::load(std::vector<uint64_t> *image) {
+    std::vector<uint64_t> words(wordCount);
+    bool found = false;
+    for (int slot = 0; slot < 2; slot++) {
+        DirtyMapHeader header;
+        iovec iov[2] = {{&header, sizeof(header)}, {words.data(), wordCount * sizeof(uint64_t)}};
+        auto want = (ssize_t)(iov[0].iov_len + iov[1].iov_len);
+        if (preadv(fd, iov, 2, slot * slotSize) != want) continue;
+        if (header.magic != DIRTY_MAP_MAGIC || header.version != DIRTY_MAP_VERSION || header.block_size != BLOCK_SIZE ||
+            header.size != volumeSize || header.checksum != image_checksum(words)) continue;
+        if (!found || header.generation > generation) {
+            found = true;
+            generation = header.generation;
+            *image = words;
+        }
+    }
+    if (found) {
+        onDisk = *image;
+    }
+    return found;
+}
+
+void DirtyMapFile::start(std::function<void(std::vector<uint64_t> *)> snapshot) {
+    this->snapshot = std::move(snapshot);
+    flusher = std::thread(&DirtyMapFile::flush_loop, this);
+}
+
+void DirtyMapFile::sync() {
+    std::unique_lock lock(mtx);
+    auto ticket = ++requested;
+    cv.notify_all();
+    cv.wait(lock, [&] { return flushed >= ticket; });
+}
+
+void DirtyMapFile::flush_loop() {
+    std::unique_lock lock(mtx);
+    while (!stopping) {
+        // Flush as soon as a writer is waiting, or else every so often for the cleared bits
+        cv.wait_for(lock, std::chrono::milliseconds(DIRTY_MAP_FLUSH_MS), [this] { return requested > flushed || stopping; });
+        // Everyone waiting now set their bits before this snapshot is taken
+        auto target = requested;
+        lock.unlock();
+        flush();
+        lock.lock();
+        flushed = target;
+        cv.notify_all();
+    }
+}
+
+void DirtyMapFile::flush() {
+    std::vector<uint64_t> image(wordCount);
+    snapshot(&image);
+    if (image == onDisk) {
+        return;
+    }
+
+    // Overwrite the older slot, so the newest stays intact until this one is durable
+    DirtyMapHeader header = {DIRTY_MAP_MAGIC, DIRTY_MAP_VERSION, BLOCK_SIZE, 0, volumeSize, generation + 1, image_checksum(image)};
+    iovec iov[2] = {{&header, sizeof(header)}, {image.data(), wordCount * sizeof(uint64_t)}};
+    auto want = (ssize_t)(iov[0].iov_len + iov[1].iov_len);
+    if (pwritev(fd, iov, 2, (header.generation % 2) * slotSize) != want || fdatasync(fd) != 0) {
+        // Writers are waiting on this to acknowledge; without it a restart could
+        // miss their blocks. This runs on the flusher thread, so stop here (as GroupCommit does).
+        std::cerr << "dirty map flush failed: " << strerror(errno) << "; aborting" << std::endl;
+        abort();
+    }
+    generation = header.generation;
+    onDisk.swap(image);
+}
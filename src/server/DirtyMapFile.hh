@@ -0,0 +1,60 @@
+#ifndef DIRTYMAPFILE_HH
+#define DIRTYMAPFILE_HH
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How often cleared bits are written back to the dirty map file
+#define DIRTY_MAP_FLUSH_MS 1000
+
+// Keeps a copy of the dirty bitmap on disk (<fileName>.dirty), so a node that
+// restarts while its partner is away still knows which blocks to resync.
+// Set bits are write-intent: a write that dirties a new block calls sync(),
+// which returns once the bit is on disk, and writers arriving together share
+// one flush. Writes to blocks that are already dirty cost nothing. Cleared bits
+// are written behind every DIRTY_MAP_FLUSH_MS, since a stale bit only means a
+// block gets sent again.
+// Each flush goes to the other of two slots, tagged with a generation number
+// and a checksum, so a torn write leaves the previous image intact.
+class DirtyMapFile {
+    int fd;
+    uint64_t volumeSize;
+    size_t wordCount;
+    size_t slotSize;
+    uint64_t generation = 0;
+
+    // Fills the image to persist
+    std::function<void(std::vector<uint64_t> *)> snapshot;
+    // What the newest slot holds, so unchanged images aren't rewritten
+    std::vector<uint64_t> onDisk;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    // sync() calls so far, and how many of those a flush has covered
+    uint64_t requested = 0;
+    uint64_t flushed = 0;
+    bool stopping = false;
+    std::thread flusher;
+
+    void flush_loop();
+    void flush();
+
+   public:
+    DirtyMapFile(const std::string &fileName, uint64_t volumeSize, size_t wordCount);
+    ~DirtyMapFile();
+
+    // Read the newest intact image; false if there is none (or it describes another volume)
+    bool load(std::vector<uint64_t> *image);
+    // Begin flushing whatever `snapshot` reports. Call after load.
+    void start(std::function<void(std::vector<uint64_t> *)> snapshot);
+    // Returns once every bit set before the call is on disk
+    void sync();
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "FileStorage.hh"
 #include "../shared/CommonDefinitions.hh"
+#include "ZeroBlock.hh"
+#include <algorithm>
 #include <exception>
 #include <filesystem>
 #include <fstream>
@@ -8,76 +10,517 @@
 #include <memory>
 #include <string>
 #include <shared_mutex>
+#include <stdexcept>
 #include <thread>
 #include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <unistd.h>
 
 using std::string;
 
 
 /**
  * All blocks are stored within this large file at some specific offsets.
- * The first time a server starts, it should initialize this file with 0s.
- * Writes are protected by the lock.
+ * The first time a server starts, it initializes this file with 0s (by
+ * allocating it, which is near-instant). A small superblock kept alongside the
+ * file records the volume geometry and whether it was shut down cleanly, so
+ * later starts reuse the existing data instead of re-initializing it.
+ * Each op holds the stripe lock(s) for the block(s) it touches: reads share,
+ * writes are exclusive, so a block is never observed half-written.
+ *
+ * The file is opened once and kept open for the lifetime of the storage object;
+ * each block op is a single positioned pread/pwrite on that descriptor, straight
+ * from/into the caller's buffer.
+ *
+ * Writes are durable when write_data returns. Concurrent writers share
+ * fdatasync calls through a group commit rather than paying for one each.
+ * Optionally, writes are instead made durable by appending them to a journal
+ * (see Journal.hh), with the in-place copy synced later by its checkpointer.
+ *
+ * If enabled, a block cache sits in front of the file. It is filled on read
+ * misses and written through on every write, under the same block locks as
+ * the file I/O, so it can never serve stale data.
+ *
+ * In O_DIRECT mode the page cache is bypassed, so transfers must be block
+ * aligned in memory, offset and length. Data is staged through a pooled aligned
+ * buffer, and an op at an unaligned offset becomes a read-modify-write of the
+ * two blocks it straddles (both are covered by the op's stripe locks).
+ *
+ * Optionally, an aligned block written as all zeros is punched out of the file
+ * instead, so sparse volumes stay sparse on disk. It reads back as zeros.
  *
  * My ideas on crash & recovery:
  * If one server crashes, the other one could use a map structure to keep track of new writes <offset, 4k block>,
  * so that after that server recovers from the crash, it retrieves and replays all the writes in the map and files will be identical again.
  * I think crash during writes is trivial, since the client could just direct the write to the other server and that broken block will get overwritten later.
  */
-struct Block
-{
-    char data[BLOCK_SIZE];
+
+FileStorage::FileStorage(string fileName, bool direct) : fileName(fileName) {
+    fd = open(fileName.c_str(), O_RDWR | O_CREAT | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Unable to open storage file " + fileName + ": " + strerror(errno));
+    }
+    if (direct) {
+        buffers = std::make_unique<AlignedBufferPool>(DIRECT_IO_BUFFERS, 2 * BLOCK_SIZE);
+    }
+    commit = std::make_unique<GroupCommit>(fd);
+}
+
+FileStorage::~FileStorage() {
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (sb_fd >= 0) {
+        close(sb_fd);
+    }
+}
+
+#define SUPERBLOCK_MAGIC 0x45524f5453424b42ull  // "BKBSTORE"
+#define SUPERBLOCK_VERSION 1
+
+struct Superblock {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t size;
+    uint32_t clean;
+    uint32_t reserved;
 };
 
-FileStorage::FileStorage(string fileName) : fileName(fileName) {}
+// Transfer exactly len bytes, retrying on short transfers and EINTR.
+// A single call is the common case.
+static void write_exact(int fd, uint64_t offset, const char *in, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        auto n = pwrite(fd, in + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(string("pwrite failed: ") + strerror(errno));
+        }
+        done += n;
+    }
+}
+
+static void read_exact(int fd, uint64_t offset, char *out, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        auto n = pread(fd, out + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(string("pread failed: ") + strerror(errno));
+        }
+        if (n == 0) {
+            // Past the end of the file; unwritten space reads as zeros
+            memset(out + done, 0, len - done);
+            return;
+        }
+        done += n;
+    }
+}
+
+// Vectored versions: the buffers are laid end to end from offset
+static void writev_exact(int fd, uint64_t offset, std::vector<iovec> iov) {
+    size_t i = 0;
+    while (i < iov.size()) {
+        auto n = pwritev(fd, &iov[i], std::min(iov.size() - i, (size_t)IOV_MAX), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(string("pwritev failed: ") + strerror(errno));
+        }
+        offset += n;
+        // Skip past what was transferred
+        while (i < iov.size() && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if (n > 0) {
+            iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + n;
+            iov[i].iov_len -= n;
+        }
+    }
+}
+
+static void readv_exact(int fd, uint64_t offset, std::vector<iovec> iov) {
+    size_t i = 0;
+    while (i < iov.size()) {
+        auto n = preadv(fd, &iov[i], std::min(iov.size() - i, (size_t)IOV_MAX), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(string("preadv failed: ") + strerror(errno));
+        }
+        if (n == 0) {
+            // Past the end of the file; unwritten space reads as zeros
+            for (; i < iov.size(); i++) memset(iov[i].iov_base, 0, iov[i].iov_len);
+            return;
+        }
+        offset += n;
+        while (i < iov.size() && (size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if (n > 0) {
+            iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + n;
+            iov[i].iov_len -= n;
+        }
+    }
+}
+
+// Offsets of the blocks making up an extent
+std::vector<uint64_t> FileStorage::extent_blocks(uint64_t offset, const std::vector<iovec> &iov) {
+    std::vector<uint64_t> offsets;
+    for (auto &v : iov) {
+        if (v.iov_len % BLOCK_SIZE != 0) {
+            throw std::invalid_argument("Extent buffers should hold whole blocks (got " + std::to_string(v.iov_len) + " bytes)");
+        }
+        for (size_t done = 0; done < v.iov_len; done += BLOCK_SIZE) {
+            offsets.push_back(offset);
+            offset += BLOCK_SIZE;
+        }
+    }
+    return offsets;
+}
+
+bool FileStorage::write_superblock(uint64_t size, bool clean) {
+    Superblock sb = {SUPERBLOCK_MAGIC, SUPERBLOCK_VERSION, BLOCK_SIZE, size, clean ? 1u : 0u, 0};
+    return pwrite(sb_fd, &sb, sizeof(sb), 0) == sizeof(sb) && fdatasync(sb_fd) == 0;
+}
+
+// Fill the volume with 0s by allocating it rather than writing it out
+void FileStorage::format(uint64_t size) {
+    if (ftruncate(fd, 0) != 0) {
+        std::cerr << "problem truncating file: " << strerror(errno) << std::endl;
+    }
+    if (fallocate(fd, 0, 0, size) != 0) {
+        // Filesystem can't preallocate; a sparse file reads back as 0s all the same
+        if (ftruncate(fd, size) != 0) {
+            std::cerr << "problem sizing file: " << strerror(errno) << std::endl;
+        }
+    }
+    fdatasync(fd);
+}
 
-// initialize this file with 0s.
 // fileSize in MB
 void FileStorage::init(int fileSize)
 {
-    std::vector<char> empty(1024, 0);
-    std::ofstream ofs(fileName, std::ios::binary | std::ios::out);
+    uint64_t size = (uint64_t)fileSize * 1024 * 1024;
+    BlockLockTable::AllGuard guard(locks);
 
-    for (int i = 0; i < 1024 * fileSize; i++)
-    {
-        if (!ofs.write(&empty[0], empty.size()))
-        {
-            std::cerr << "problem writing to file" << std::endl;
+    if (sb_fd < 0) {
+        sb_fd = open((fileName + ".super").c_str(), O_RDWR | O_CREAT, 0644);
+        if (sb_fd < 0) {
+            throw std::runtime_error("Unable to open superblock for " + fileName + ": " + strerror(errno));
         }
     }
-    ofs.close();
+
+    Superblock sb;
+    struct stat st;
+    bool existing = pread(sb_fd, &sb, sizeof(sb), 0) == sizeof(sb) && sb.magic == SUPERBLOCK_MAGIC &&
+                    sb.version == SUPERBLOCK_VERSION && sb.block_size == BLOCK_SIZE && sb.size == size &&
+                    fstat(fd, &st) == 0 && (uint64_t)st.st_size >= size;
+
+    if (existing) {
+        wasClean = sb.clean != 0;
+        std::cout << "Reusing existing volume (" << (wasClean ? "clean" : "unclean") << " shutdown)" << std::endl;
+    } else {
+        // Invalidate any old superblock first, so a crash mid-format can't leave
+        // a half-initialized volume looking valid
+        write_superblock(0, false);
+        format(size);
+        wasClean = true;
+        formatted = true;
+        std::cout << "Initialized new volume" << std::endl;
+    }
+
+    // Mark the volume in use until shutdown() says otherwise
+    if (!write_superblock(size, false)) {
+        throw std::runtime_error("Unable to write superblock for " + fileName + ": " + strerror(errno));
+    }
+    volumeSize = size;
+
+    if (journal) {
+        if (formatted) {
+            // Left over from the volume that was replaced; replaying it would
+            // write old blocks into the new one
+            journal->discard();
+        } else if (wasClean) {
+            // shutdown() synced the block file, so every record is already in place
+            journal->discard();
+        } else {
+            auto replayed = journal->replay([this](uint64_t address, const char *data) { write_block(address, data); });
+            if (replayed > 0) {
+                std::cout << "Replayed " << replayed << " journal records" << std::endl;
+            }
+        }
+        journal->start();
+    }
+}
+
+void FileStorage::enable_cache(size_t capacityBytes) {
+    cache = std::make_unique<BlockCache>(capacityBytes);
+}
+
+void FileStorage::enable_hash_tree() {
+    tree = std::make_unique<HashTree>(volumeSize);
+}
+
+void FileStorage::refresh_hash_tree() {
+    // Extent reads bypass the cache, so hashing the volume doesn't evict the working set
+    tree->refresh([this](uint64_t offset, const std::vector<iovec> &iov) { read_extent(offset, iov); });
+}
+
+void FileStorage::configure_commit(size_t maxBatch, int maxWaitUs) {
+    commit->configure(maxBatch, maxWaitUs);
+    // In journaled mode, writes are acknowledged through the journal's own commits
+    if (journal) {
+        journal->configure_commit(maxBatch, maxWaitUs);
+    }
+}
+
+void FileStorage::enable_journal() {
+    journal = std::make_unique<Journal>(fileName, fd);
+}
+
+void FileStorage::shutdown() {
+    BlockLockTable::AllGuard guard(locks);
+    if (fdatasync(fd) != 0 || !write_superblock(volumeSize, true)) {
+        std::cerr << "problem recording clean shutdown: " << strerror(errno) << std::endl;
+    }
 }
 
 // there's no need to handle crash during writes
 void FileStorage::write_data(uint64_t offset, const char *in)
 {
-    mtx.lock();
-    Block block;
-    std::ofstream ofs(fileName, std::ios::binary | std::ios::out);
-    strcpy(block.data, in);
-    ofs.seekp(offset, std::ios::beg);
-    ofs.write(reinterpret_cast<char *>(&block), sizeof(block));
-    ofs.close();
-    mtx.unlock();
+    int segment = 0;
+    {
+        BlockLockTable::WriteGuard guard(locks, offset);
+        write_block(offset, in);
+        if (cache) {
+            cache->update(offset, in);
+        }
+        if (tree) {
+            tree->invalidate(offset);
+        }
+        if (journal) {
+            segment = journal->append(offset, in);
+        }
+    }
+
+    // Wait for durability outside the block lock, so the block stays available meanwhile
+    if (journal) {
+        journal->commit(segment);
+    } else {
+        commit->commit();
+    }
+}
+
+void FileStorage::write_batch(const std::vector<std::pair<uint64_t, const char *>> &blocks)
+{
+    std::vector<uint64_t> offsets;
+    for (auto &block : blocks) offsets.push_back(block.first);
+
+    // A checkpoint may rotate the journal mid-batch, so track each segment written
+    std::vector<int> segments;
+    {
+        BlockLockTable::BatchGuard guard(locks, offsets, false);
+        bool perBlock = buffers || punchZeroBlocks;
+        if (!perBlock) {
+            // Runs of neighbouring blocks go out as one pwritev each
+            std::vector<iovec> run;
+            uint64_t start = 0;
+            for (auto &block : blocks) {
+                if (!run.empty() && block.first != start + run.size() * BLOCK_SIZE) {
+                    writev_exact(fd, start, run);
+                    run.clear();
+                }
+                if (run.empty()) {
+                    start = block.first;
+                }
+                run.push_back({const_cast<char *>(block.second), BLOCK_SIZE});
+            }
+            if (!run.empty()) {
+                writev_exact(fd, start, run);
+            }
+        }
+        for (auto &block : blocks) {
+            if (perBlock) {
+                write_block(block.first, block.second);
+            }
+            if (cache) {
+                cache->update(block.first, block.second);
+            }
+            if (tree) {
+                tree->invalidate(block.first);
+            }
+            if (journal) {
+                auto segment = journal->append(block.first, block.second);
+                if (std::find(segments.begin(), segments.end(), segment) == segments.end()) {
+                    segments.push_back(segment);
+                }
+            }
+        }
+    }
+
+    // One commit covers the whole batch
+    if (journal) {
+        for (auto segment : segments) journal->commit(segment);
+    } else {
+        commit->commit();
+    }
+}
+
+void FileStorage::read_batch(const std::vector<std::pair<uint64_t, char *>> &blocks)
+{
+    std::vector<uint64_t> offsets;
+    for (auto &block : blocks) offsets.push_back(block.first);
+
+    BlockLockTable::BatchGuard guard(locks, offsets, true);
+    for (auto &block : blocks) {
+        if (cache && cache->lookup(block.first, block.second)) {
+            continue;
+        }
+        read_block(block.first, block.second);
+        if (cache) {
+            cache->insert(block.first, block.second);
+        }
+    }
+}
+
+void FileStorage::write_extent(uint64_t offset, const std::vector<iovec> &iov)
+{
+    auto offsets = extent_blocks(offset, iov);
+
+    std::vector<int> segments;
+    {
+        BlockLockTable::BatchGuard guard(locks, offsets, false);
+        bool perBlock = buffers || punchZeroBlocks;
+        if (!perBlock) {
+            writev_exact(fd, offset, iov);
+        }
+
+        // Per-block bookkeeping
+        size_t i = 0;
+        for (auto &v : iov) {
+            for (size_t done = 0; done < v.iov_len; done += BLOCK_SIZE, i++) {
+                auto in = static_cast<const char *>(v.iov_base) + done;
+                if (perBlock) {
+                    // O_DIRECT can't use the caller's buffers, and zero blocks may become holes
+                    write_block(offsets[i], in);
+                }
+                if (cache) {
+                    cache->update(offsets[i], in);
+                }
+                if (tree) {
+                    tree->invalidate(offsets[i]);
+                }
+                if (journal) {
+                    auto segment = journal->append(offsets[i], in);
+                    if (std::find(segments.begin(), segments.end(), segment) == segments.end()) {
+                        segments.push_back(segment);
+                    }
+                }
+            }
+        }
+    }
+
+    if (journal) {
+        for (auto segment : segments) journal->commit(segment);
+    } else {
+        commit->commit();
+    }
+}
+
+void FileStorage::read_extent(uint64_t offset, const std::vector<iovec> &iov)
+{
+    auto offsets = extent_blocks(offset, iov);
+
+    BlockLockTable::BatchGuard guard(locks, offsets, true);
+    if (!buffers) {
+        readv_exact(fd, offset, iov);
+        return;
+    }
+
+    // O_DIRECT: stage each block through the pool
+    size_t i = 0;
+    for (auto &v : iov) {
+        for (size_t done = 0; done < v.iov_len; done += BLOCK_SIZE, i++) {
+            read_block(offsets[i], static_cast<char *>(v.iov_base) + done);
+        }
+    }
+}
+
+// Caller holds the block's write lock
+void FileStorage::write_block(uint64_t offset, const char *in)
+{
+    if (punchZeroBlocks && offset % BLOCK_SIZE == 0 && IsZeroBlock(in, BLOCK_SIZE) &&
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, BLOCK_SIZE) == 0) {
+        // Made durable by the same fdatasync as a write
+        return;
+    }
+
+    if (!buffers) {
+        write_exact(fd, offset, in, BLOCK_SIZE);
+        return;
+    }
+
+    auto lease = buffers->acquire();
+    auto aligned = offset - offset % BLOCK_SIZE;
+    size_t span = offset == aligned ? BLOCK_SIZE : 2 * BLOCK_SIZE;
+    if (span != BLOCK_SIZE) {
+        read_exact(fd, aligned, lease.data(), span);
+    }
+    memcpy(lease.data() + (offset - aligned), in, BLOCK_SIZE);
+    write_exact(fd, aligned, lease.data(), span);
 }
 
 void FileStorage::read_data(uint64_t offset, char *out)
 {
     // Usage example:
     // FileStorage fs("output");
-    // char input[] = {'p', '0', 'q', 'v', 'w', '2'};
+    // char input[BLOCK_SIZE] = {'p', '0', 'q', 'v', 'w', '2'};
     // int offset = 762;
     // fs.write_data(offset, input);
     // char output[BLOCK_SIZE];
     // fs.read_data(offset, output);
-    
-    mtx.lock();
-    Block block;
-    std::ifstream ifs(fileName, std::ios::binary | std::ios::in);
-    ifs.seekg(offset, std::ios::beg);
-    ifs.read(reinterpret_cast<char *>(&block), sizeof(block));
-    strcpy(out, block.data);
-    ifs.close();
-    mtx.unlock();
-}
\ No newline at end of file
+
+    BlockLockTable::ReadGuard guard(locks, offset);
+    if (cache && cache->lookup(offset, out)) {
+        return;
+    }
+    read_block(offset, out);
+    if (cache) {
+        cache->insert(offset, out);
+    }
+}
+
+// Caller holds the block's read lock
+void FileStorage::read_block(uint64_t offset, char *out)
+{
+    if (!buffers) {
+        read_exact(fd, offset, out, BLOCK_SIZE);
+        return;
+    }
+
+    auto lease = buffers->acquire();
+    auto aligned = offset - offset % BLOCK_SIZE;
+    size_t span = offset == aligned ? BLOCK_SIZE : 2 * BLOCK_SIZE;
+    read_exact(fd, aligned, lease.data(), span);
+    memcpy(out, lease.data() + (offset - aligned), BLOCK_SIZE);
+}
+
+void FileStorage::read_into(uint64_t offset, string *out)
+{
+    out->resize(BLOCK_SIZE);
+    read_data(offset, &(*out)[0]);
+}
+
+void FileStorage::write_from(uint64_t offset, const string &in)
+{
+    if (in.size() != BLOCK_SIZE) {
+        throw std::invalid_argument("Block size should be " + std::to_string(BLOCK_SIZE) + " (was " + std::to_string(in.size()) + ")");
+    }
+    write_data(offset, in.data());
+}
@@ -1,23 +1,109 @@
 #ifndef FILESTORAGE_H
 #define FILESTORAGE_H
 
+#include <sys/uio.h>
+
+#include <memory>
 #include <shared_mutex>
 #include <string>
+#include <utility>
+#include <vector>
+
+#include "AlignedBufferPool.hh"
+#include "BlockCache.hh"
+#include "BlockLockTable.hh"
+#include "GroupCommit.hh"
+#include "HashTree.hh"
+#include "Journal.hh"
 using std::string;
 
+// Aligned bounce buffers kept for O_DIRECT mode (each holds two blocks)
+#define DIRECT_IO_BUFFERS 64
+
 class FileStorage {
-   private:
+   protected:
     string fileName;
-    std::mutex mtx;
+    int fd = -1;
+    BlockLockTable locks;
+
+    // Set in O_DIRECT mode: I/O goes through aligned buffers from this pool
+    std::unique_ptr<AlignedBufferPool> buffers;
+
+    // Sidecar superblock (<fileName>.super) describing the volume
+    int sb_fd = -1;
+    uint64_t volumeSize = 0;
+    bool wasClean = false;
+    bool formatted = false;
+
+    // Makes write_data durable before it returns
+    std::unique_ptr<GroupCommit> commit;
+    // Set in journaled mode: writes are made durable through the journal instead
+    std::unique_ptr<Journal> journal;
+
+    // Optional cache of recently used blocks, kept under the block locks
+    std::unique_ptr<BlockCache> cache;
+    // Optional hash tree over the volume; writes mark their blocks stale in it
+    std::unique_ptr<HashTree> tree;
+
+    // Store aligned blocks of zeros as holes in the file instead of writing them out
+    bool punchZeroBlocks = false;
+
+    void write_block(uint64_t offset, const char *in);
+    void read_block(uint64_t offset, char *out);
+    void format(uint64_t size);
+    bool write_superblock(uint64_t size, bool clean);
+    static std::vector<uint64_t> extent_blocks(uint64_t offset, const std::vector<iovec> &iov);
 
    public:
-    FileStorage(string fileName);
+    FileStorage(string fileName, bool direct = false);
+    virtual ~FileStorage();
+    FileStorage(const FileStorage &) = delete;
+    FileStorage &operator=(const FileStorage &) = delete;
 
-    // initialize this file with 0s.
+    // Open the volume, initializing it with 0s unless the superblock shows an
+    // existing volume of the same geometry.
     // fileSize in MB
-    void init(int fileSize);
-    void write_data(uint64_t offset, const char *in);
-    void read_data(uint64_t offset, char *out);
+    virtual void init(int fileSize);
+    // Flush the volume and record a clean shutdown in the superblock
+    virtual void shutdown();
+    // Whether init had to create the volume from scratch
+    bool was_formatted() { return formatted; }
+    // Acknowledge writes once journaled (call before init)
+    void enable_journal();
+    // Serve repeated reads from memory, up to this many bytes of blocks
+    void enable_cache(size_t capacityBytes);
+    // Deallocate blocks that are overwritten with zeros (where the filesystem allows it)
+    void enable_hole_punching() { punchZeroBlocks = true; }
+    BlockCache *get_cache() { return cache.get(); }
+    // Keep a hash tree over the volume (call after init)
+    void enable_hash_tree();
+    HashTree *get_hash_tree() { return tree.get(); }
+    // Bring the hash tree up to date with every write made so far
+    void refresh_hash_tree();
+    // Tune how writes are grouped under one fdatasync
+    void configure_commit(size_t maxBatch, int maxWaitUs);
+    // Block ops on raw buffers of exactly BLOCK_SIZE bytes (arbitrary binary data)
+    virtual void write_data(uint64_t offset, const char *in);
+    virtual void read_data(uint64_t offset, char *out);
+
+    // Multi-block ops. Every block involved stays locked for the whole op, so
+    // concurrent ops see all of a batch or none of it. Writes are applied in
+    // order and made durable together before write_batch returns.
+    virtual void write_batch(const std::vector<std::pair<uint64_t, const char *>> &blocks);
+    virtual void read_batch(const std::vector<std::pair<uint64_t, char *>> &blocks);
+
+    // Contiguous multi-block ops: the buffers are laid end to end from offset,
+    // and each must hold a whole number of blocks. Issued as single
+    // pwritev/preadv calls. Isolated and durable like the batch ops.
+    // Extent reads bypass the cache, so bulk scans don't evict the working set.
+    virtual void write_extent(uint64_t offset, const std::vector<iovec> &iov);
+    virtual void read_extent(uint64_t offset, const std::vector<iovec> &iov);
+
+    // Read a block straight into a string, e.g. a response's bytes field
+    void read_into(uint64_t offset, string *out);
+    // Write a block straight from a string, e.g. a request's bytes field.
+    // Throws std::invalid_argument unless it holds exactly BLOCK_SIZE bytes.
+    void write_from(uint64_t offset, const string &in);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,53 @@
+#include "GroupCommit.hh"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+GroupCommit::GroupCommit(int fd, size_t maxBatch, int maxWaitUs) : fd(fd) {
+    configure(maxBatch, maxWaitUs);
+}
+
+void GroupCommit::configure(size_t maxBatch, int maxWaitUs) {
+    std::lock_guard lock(mtx);
+    this->maxBatch = maxBatch > 0 ? maxBatch : 1;
+    this->maxWait = std::chrono::microseconds(maxWaitUs);
+}
+
+void GroupCommit::commit() {
+    std::unique_lock lock(mtx);
+    auto ticket = ++written;
+    if (written - durable >= maxBatch) {
+        // Batch is full; let a gathering leader go ahead
+        cv.notify_all();
+    }
+
+    while (durable < ticket) {
+        if (syncing) {
+            cv.wait(lock);
+            continue;
+        }
+
+        // Lead this batch
+        syncing = true;
+        cv.wait_for(lock, maxWait, [this] { return written - durable >= maxBatch; });
+        auto target = written;
+        lock.unlock();
+
+        if (fdatasync(fd) != 0) {
+            // After a failed fdatasync the state of the written pages is unknown,
+            // so there is no safe way to keep acknowledging writes, or to retry.
+            // Throwing would leave `syncing` set and every later writer waiting.
+            std::cerr << "fdatasync failed: " << strerror(errno) << "; aborting" << std::endl;
+            abort();
+        }
+
+        lock.lock();
+        durable = target;
+        syncing = false;
+        cv.notify_all();
+    }
+}
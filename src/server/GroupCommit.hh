@@ -0,0 +1,42 @@
+#ifndef GROUPCOMMIT_HH
+#define GROUPCOMMIT_HH
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Default cap on writes covered by one fdatasync
+#define GROUP_COMMIT_MAX_BATCH 64
+// Default time a commit leader waits for more writers to join its batch
+#define GROUP_COMMIT_MAX_WAIT_US 200
+
+// Makes writes to a descriptor durable in groups.
+// Each writer calls commit() once its data has been written. The first writer
+// to find no sync in progress becomes the leader: it waits up to maxWait for
+// the batch to reach maxBatch writers, then issues a single fdatasync and
+// releases every writer it covered. Writers arriving during a sync form the
+// next batch.
+class GroupCommit {
+    int fd;
+    size_t maxBatch;
+    std::chrono::microseconds maxWait;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    // Writes handed to commit() so far, and how many of those are durable
+    uint64_t written = 0;
+    uint64_t durable = 0;
+    bool syncing = false;
+
+   public:
+    GroupCommit(int fd, size_t maxBatch = GROUP_COMMIT_MAX_BATCH, int maxWaitUs = GROUP_COMMIT_MAX_WAIT_US);
+    void configure(size_t maxBatch, int maxWaitUs);
+
+    // Returns once every write made before the call is on disk
+    void commit();
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "HashTree.hh"
+
+#include <string>
+
+#include "../shared/CommonDefinitions.hh"
+#include "ContentIndex.hh"
+#include "ZeroBlock.hh"
+
+HashTree::HashTree(uint64_t volumeBytes) : blockCount(volumeBytes / BLOCK_SIZE), stale(volumeBytes) {
+    size_t count = blockCount;
+    while (true) {
+        counts.push_back(count);
+        nodes.emplace_back(new std::atomic<uint64_t>[count]());
+        if (count <= 1) break;
+        count = (count + HASH_TREE_FANOUT - 1) / HASH_TREE_FANOUT;
+    }
+    stale.MarkAll();
+}
+
+uint64_t HashTree::block_hash(uint64_t block, const char *data) {
+    // Most of a fresh volume is zeros
+    static const uint64_t zeroHash = ContentIndex::Hash(ZeroBlock());
+    auto h = IsZeroBlock(data, BLOCK_SIZE) ? zeroHash : ContentIndex::Hash(data, BLOCK_SIZE);
+    // Tie the content to its position, so the same blocks in other places sum differently
+    h ^= (block + 1) * 0x9e3779b97f4a7c15ull;
+    h *= 0xbf58476d1ce4e5b9ull;
+    return h ^ (h >> 31);
+}
+
+void HashTree::set_leaf(uint64_t block, uint64_t hash) {
+    auto delta = hash - nodes[0][block].exchange(hash, std::memory_order_relaxed);
+    if (delta == 0) {
+        return;
+    }
+    auto index = block;
+    for (size_t level = 1; level < counts.size(); level++) {
+        index /= HASH_TREE_FANOUT;
+        nodes[level][index].fetch_add(delta, std::memory_order_relaxed);
+    }
+}
+
+size_t HashTree::refresh(std::function<void(uint64_t offset, const std::vector<iovec> &iov)> read) {
+    std::lock_guard lock(refreshMutex);
+    std::vector<uint64_t> blocks;
+    std::string buffer(HASH_TREE_REFRESH_BLOCKS * BLOCK_SIZE, '\0');
+    std::vector<iovec> iov;
+    size_t cursor = 0;
+    size_t rehashed = 0;
+
+    while (stale.Take(&cursor, &blocks, HASH_TREE_REFRESH_BLOCKS)) {
+        // Taking clears the bits first, so a write landing after this read marks its block again
+        for (size_t i = 0; i < blocks.size();) {
+            // Read each contiguous run with one call
+            size_t run = 1;
+            while (i + run < blocks.size() && run < HASH_TREE_REFRESH_BLOCKS && blocks[i + run] == blocks[i] + run * BLOCK_SIZE) {
+                run++;
+            }
+            iov.assign(1, {&buffer[0], run * BLOCK_SIZE});
+            read(blocks[i], iov);
+            for (size_t j = 0; j < run; j++) {
+                auto block = blocks[i + j] / BLOCK_SIZE;
+                set_leaf(block, block_hash(block, &buffer[j * BLOCK_SIZE]));
+            }
+            i += run;
+            rehashed += run;
+        }
+    }
+    hashed.store(true, std::memory_order_release);
+    return rehashed;
+}
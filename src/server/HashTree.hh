@@ -0,0 +1,60 @@
+#ifndef HASHTREE_HH
+#define HASHTREE_HH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "DirtyBitmap.hh"
+
+// Children per hash tree node (1 GiB of 4 KiB blocks is six levels)
+#define HASH_TREE_FANOUT 16
+// Stale blocks rehashed per read
+#define HASH_TREE_REFRESH_BLOCKS 256
+
+// Hash tree over the volume, so two nodes can find the blocks that differ by
+// comparing hashes from the top down (see CompareTree) rather than contents.
+// Level 0 has one hash per block, mixing its content with its position; each
+// node above is the sum of its children, so a block's change is added to its
+// ancestors without locking or rehashing its siblings.
+// Writes only mark their blocks stale; refresh() reads and rehashes whatever
+// is stale, in address order. Everything starts stale, so the first refresh
+// hashes the whole volume; until it has finished, the nodes mean nothing.
+class HashTree {
+    uint64_t blockCount;
+    std::vector<size_t> counts;
+    std::vector<std::unique_ptr<std::atomic<uint64_t>[]>> nodes;
+    DirtyBitmap stale;
+    // One refresh at a time
+    std::mutex refreshMutex;
+    // The first refresh has finished
+    std::atomic<bool> hashed{false};
+
+    void set_leaf(uint64_t block, uint64_t hash);
+
+   public:
+    HashTree(uint64_t volumeBytes);
+
+    static uint64_t block_hash(uint64_t block, const char *data);
+
+    // A write has changed the block(s) at this offset
+    void invalidate(uint64_t offset) { stale.Mark(offset); }
+    // Rehash the stale blocks, reading runs of them with `read` (laid end to
+    // end from an aligned offset, like read_extent). Returns how many were rehashed.
+    size_t refresh(std::function<void(uint64_t offset, const std::vector<iovec> &iov)> read);
+    // Whether every block has been hashed at least once
+    bool ready() { return hashed.load(std::memory_order_acquire); }
+
+    // Level 0 is the blocks; the top level has a single node
+    int levels() { return counts.size(); }
+    size_t node_count(int level) { return counts[level]; }
+    uint64_t node(int level, size_t index) { return nodes[level][index].load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include "Journal.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "../shared/CommonDefinitions.hh"
+
+#define JOURNAL_MAGIC 0x4c4e524au  // "JRNL"
+
+struct JournalRecordHeader {
+    uint32_t magic;
+    uint32_t checksum;  // crc32 over the rest of the header and the payload
+    uint64_t seq;
+    uint64_t address;
+};
+
+#define JOURNAL_RECORD_SIZE (sizeof(JournalRecordHeader) + BLOCK_SIZE)
+
+static uint32_t crc32_update(uint32_t crc, const char *data, size_t len) {
+    static uint32_t table[256];
+    static bool ready = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)ready;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t record_checksum(const JournalRecordHeader &header, const char *data) {
+    auto crc = crc32_update(0, reinterpret_cast<const char *>(&header.seq), sizeof(header.seq) + sizeof(header.address));
+    return crc32_update(crc, data, BLOCK_SIZE);
+}
+
+Journal::Journal(string baseName, int dataFd) : baseName(baseName), dataFd(dataFd) {
+    for (int i = 0; i < 2; i++) {
+        auto name = baseName + ".journal." + std::to_string(i);
+        segments[i].fd = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (segments[i].fd < 0) {
+            throw std::runtime_error("Unable to open journal " + name + ": " + strerror(errno));
+        }
+        segments[i].commit = std::make_unique<GroupCommit>(segments[i].fd);
+    }
+}
+
+Journal::~Journal() {
+    if (checkpointer.joinable()) {
+        {
+            std::lock_guard lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        checkpointer.join();
+    }
+    for (auto &segment : segments) {
+        if (segment.fd >= 0) close(segment.fd);
+    }
+}
+
+size_t Journal::replay(std::function<void(uint64_t address, const char *data)> apply) {
+    struct Entry {
+        uint64_t seq;
+        int segment;
+        uint64_t offset;
+    };
+    std::vector<Entry> entries;
+    std::vector<char> record(JOURNAL_RECORD_SIZE);
+    auto header = reinterpret_cast<JournalRecordHeader *>(record.data());
+    auto payload = record.data() + sizeof(JournalRecordHeader);
+
+    // Records are fixed-size, so every slot can be checked on its own. A torn
+    // record is skipped rather than ending the scan: a later one may have been
+    // acknowledged while it was still being written.
+    for (int i = 0; i < 2; i++) {
+        struct stat st;
+        fstat(segments[i].fd, &st);
+        for (uint64_t off = 0; off + JOURNAL_RECORD_SIZE <= (uint64_t)st.st_size; off += JOURNAL_RECORD_SIZE) {
+            if (pread(segments[i].fd, record.data(), JOURNAL_RECORD_SIZE, off) != (ssize_t)JOURNAL_RECORD_SIZE) break;
+            if (header->magic != JOURNAL_MAGIC || header->checksum != record_checksum(*header, payload)) continue;
+            entries.push_back({header->seq, i, off});
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.seq < b.seq; });
+    for (auto &entry : entries) {
+        pread(segments[entry.segment].fd, record.data(), JOURNAL_RECORD_SIZE, entry.offset);
+        apply(header->address, payload);
+    }
+
+    if (fdatasync(dataFd) != 0) {
+        throw std::runtime_error(string("fdatasync failed during journal replay: ") + strerror(errno));
+    }
+    for (auto &segment : segments) {
+        reset_segment(segment);
+    }
+    return entries.size();
+}
+
+void Journal::discard() {
+    for (auto &segment : segments) {
+        reset_segment(segment);
+    }
+}
+
+void Journal::start() {
+    checkpointer = std::thread([this] { checkpoint_loop(); });
+}
+
+void Journal::reset_segment(Segment &segment) {
+    if (ftruncate(segment.fd, 0) != 0 || fdatasync(segment.fd) != 0) {
+        std::cerr << "problem truncating journal: " << strerror(errno) << std::endl;
+    }
+    segment.tail = 0;
+}
+
+int Journal::append(uint64_t address, const char *data) {
+    JournalRecordHeader header;
+    header.magic = JOURNAL_MAGIC;
+    header.address = address;
+
+    std::unique_lock lock(mtx);
+    int index = active;
+    auto &segment = segments[index];
+    header.seq = nextSeq++;
+    auto offset = segment.tail;
+    segment.tail += JOURNAL_RECORD_SIZE;
+    segment.appending++;
+    if (segment.tail >= JOURNAL_SEGMENT_MAX_BYTES) {
+        cv.notify_all();
+    }
+    lock.unlock();
+
+    header.checksum = record_checksum(header, data);
+    iovec iov[2] = {{&header, sizeof(header)}, {const_cast<char *>(data), BLOCK_SIZE}};
+    auto n = pwritev(segment.fd, iov, 2, offset);
+
+    lock.lock();
+    segment.appending--;
+    if (segment.appending == 0) cv.notify_all();
+    lock.unlock();
+
+    if (n != (ssize_t)JOURNAL_RECORD_SIZE) {
+        throw std::runtime_error(string("journal append failed: ") + strerror(errno));
+    }
+    return index;
+}
+
+void Journal::commit(int segment) {
+    segments[segment].commit->commit();
+}
+
+void Journal::configure_commit(size_t maxBatch, int maxWaitUs) {
+    for (auto &segment : segments) {
+        segment.commit->configure(maxBatch, maxWaitUs);
+    }
+}
+
+void Journal::checkpoint_loop() {
+    std::unique_lock lock(mtx);
+    while (!stopping) {
+        cv.wait_for(lock, std::chrono::milliseconds(JOURNAL_CHECKPOINT_MS),
+                    [this] { return stopping || segments[active].tail >= JOURNAL_SEGMENT_MAX_BYTES; });
+        if (stopping) break;
+        if (segments[active].tail == 0) continue;
+
+        lock.unlock();
+        checkpoint();
+        lock.lock();
+    }
+}
+
+void Journal::checkpoint() {
+    std::unique_lock lock(mtx);
+    auto &old = segments[active];
+    active = 1 - active;
+
+    // Every record in the old segment follows its in-place write, so once the
+    // last append there has landed, one sync of the block file covers them all
+    cv.wait(lock, [&old] { return old.appending == 0; });
+    lock.unlock();
+
+    if (fdatasync(dataFd) != 0) {
+        // As in GroupCommit: the in-place writes may be lost, and this thread has no caller to tell
+        std::cerr << "fdatasync failed during checkpoint: " << strerror(errno) << "; aborting" << std::endl;
+        abort();
+    }
+
+    // Appends only go to the active segment, so the old one can be emptied unlocked
+    reset_segment(old);
+}
@@ -0,0 +1,79 @@
+#ifndef JOURNAL_HH
+#define JOURNAL_HH
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "GroupCommit.hh"
+
+using std::string;
+
+// How often the checkpointer folds the journal into the block file
+#define JOURNAL_CHECKPOINT_MS 1000
+// Journal size that triggers an early checkpoint
+#define JOURNAL_SEGMENT_MAX_BYTES (64ull * 1024 * 1024)
+
+// Append-only write-ahead journal in front of the block file.
+// Each write is written in place (without syncing) and appended to the
+// journal as a checksummed record; it is acknowledged once the journal append
+// is durable, which costs a sequential write and a shared fdatasync instead of
+// a random synced write.
+//
+// The journal is split across two segment files. A background checkpointer
+// periodically switches appends to the other segment, syncs the block file
+// (which covers every in-place write recorded in the old segment) and empties
+// the old segment. After a crash, replay() applies the surviving records in
+// sequence order.
+class Journal {
+    struct Segment {
+        int fd = -1;
+        uint64_t tail = 0;
+        // Appends that have reserved space but not finished writing it
+        size_t appending = 0;
+        std::unique_ptr<GroupCommit> commit;
+    };
+
+    string baseName;
+    int dataFd;
+    Segment segments[2];
+    int active = 0;
+    uint64_t nextSeq = 1;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread checkpointer;
+
+    void checkpoint_loop();
+    void checkpoint();
+    void reset_segment(Segment &segment);
+
+   public:
+    Journal(string baseName, int dataFd);
+    ~Journal();
+
+    // Apply every intact record to the block file in sequence order, then
+    // sync it and empty the journal. Call before serving requests.
+    size_t replay(std::function<void(uint64_t address, const char *data)> apply);
+    // Empty the journal without applying it, when its records are not for
+    // the current contents of the block file (it was just formatted)
+    void discard();
+    void start();
+
+    // Append a record for a write that has just been made in place. Call with
+    // the block's write lock held, so records for a block are ordered like the
+    // writes themselves. Returns the segment to pass to commit().
+    int append(uint64_t address, const char *data);
+    // Returns once the record appended to this segment is durable
+    void commit(int segment);
+    // Set how each segment's appends are grouped into syncs (see GroupCommit)
+    void configure_commit(size_t maxBatch, int maxWaitUs);
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include "MmapFileStorage.hh"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "../shared/CommonDefinitions.hh"
+
+static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+// As after a failed fdatasync (see GroupCommit), the pages are in an unknown
+// state and writes may already have been acknowledged, so there is no carrying on
+static void msync_or_abort(void *addr, size_t len) {
+    if (msync(addr, len, MS_SYNC) != 0) {
+        std::cerr << "msync failed: " << strerror(errno) << "; aborting" << std::endl;
+        abort();
+    }
+}
+
+MmapFileStorage::MmapFileStorage(string fileName, MsyncPolicy policy) : FileStorage(fileName), policy(policy) {}
+
+MmapFileStorage::~MmapFileStorage() {
+    if (flusher.joinable()) {
+        {
+            std::lock_guard lock(flusherMutex);
+            stopping = true;
+        }
+        flusherCv.notify_all();
+        flusher.join();
+    }
+    unmap();
+}
+
+void MmapFileStorage::unmap() {
+    if (base == nullptr) return;
+
+    // Anything not yet flushed by the policy goes out now
+    msync(base, length, MS_SYNC);
+    munmap(base, length);
+    base = nullptr;
+    length = 0;
+}
+
+void MmapFileStorage::init(int fileSize) {
+    unmap();
+    FileStorage::init(fileSize);
+
+    length = (size_t)fileSize * 1024 * 1024;
+    void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        length = 0;
+        throw std::runtime_error("Unable to map storage file " + fileName + ": " + strerror(errno));
+    }
+    base = static_cast<char *>(addr);
+
+    if (policy != MsyncPolicy::PerWrite && !flusher.joinable()) {
+        flusher = std::thread([this] { flush_loop(); });
+    }
+}
+
+void MmapFileStorage::shutdown() {
+    if (base != nullptr) {
+        // Don't record a clean shutdown over pages that never made it
+        msync_or_abort(base, length);
+    }
+    FileStorage::shutdown();
+}
+
+bool MmapFileStorage::in_range(uint64_t offset) {
+    return base != nullptr && offset <= length && length - offset >= BLOCK_SIZE;
+}
+
+void MmapFileStorage::sync_range(uint64_t offset, size_t len) {
+    // msync wants a page-aligned start address
+    auto start = offset - offset % page_size;
+    msync_or_abort(base + start, offset + len - start);
+}
+
+void MmapFileStorage::sync_pages(std::vector<uint64_t> &pages) {
+    // Coalesce adjacent pages so each contiguous run costs one msync
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    size_t i = 0;
+    while (i < pages.size()) {
+        size_t j = i + 1;
+        while (j < pages.size() && pages[j] == pages[j - 1] + page_size) j++;
+        sync_range(pages[i], pages[j - 1] + page_size - pages[i]);
+        i = j;
+    }
+}
+
+void MmapFileStorage::flush_loop() {
+    std::unique_lock lock(flusherMutex);
+    while (!stopping) {
+        flusherCv.wait_for(lock, std::chrono::milliseconds(MSYNC_INTERVAL_MS));
+        if (policy == MsyncPolicy::Batch) {
+            // Flush a batch that writes stopped short of filling
+            std::vector<uint64_t> batch;
+            {
+                std::lock_guard guard(batchMutex);
+                batch.swap(pendingPages);
+            }
+            if (!batch.empty()) {
+                sync_pages(batch);
+            }
+        } else {
+            msync_or_abort(base, length);
+        }
+    }
+}
+
+void MmapFileStorage::pages_for(uint64_t offset, std::vector<uint64_t> &pages) {
+    for (auto page = offset - offset % page_size; page < offset + BLOCK_SIZE; page += page_size) {
+        pages.push_back(page);
+    }
+}
+
+void MmapFileStorage::after_write(std::vector<uint64_t> &pages) {
+    switch (policy) {
+        case MsyncPolicy::PerWrite:
+            sync_pages(pages);
+            break;
+        case MsyncPolicy::Batch: {
+            std::vector<uint64_t> batch;
+            {
+                std::lock_guard lock(batchMutex);
+                pendingPages.insert(pendingPages.end(), pages.begin(), pages.end());
+                if (pendingPages.size() >= MSYNC_BATCH_BLOCKS) {
+                    batch.swap(pendingPages);
+                }
+            }
+            // The writer that fills the batch flushes it, outside the batch lock
+            if (!batch.empty()) {
+                sync_pages(batch);
+            }
+            break;
+        }
+        case MsyncPolicy::Periodic:
+            break;
+    }
+}
+
+void MmapFileStorage::write_data(uint64_t offset, const char *in) {
+    if (!in_range(offset)) {
+        // Beyond the mapped volume; let the descriptor path handle it
+        FileStorage::write_data(offset, in);
+        return;
+    }
+
+    {
+        BlockLockTable::WriteGuard guard(locks, offset);
+        memcpy(base + offset, in, BLOCK_SIZE);
+        if (tree) {
+            tree->invalidate(offset);
+        }
+    }
+
+    std::vector<uint64_t> pages;
+    pages_for(offset, pages);
+    after_write(pages);
+}
+
+void MmapFileStorage::write_batch(const std::vector<std::pair<uint64_t, const char *>> &blocks) {
+    std::vector<uint64_t> offsets;
+    for (auto &block : blocks) {
+        if (!in_range(block.first)) {
+            FileStorage::write_batch(blocks);
+            return;
+        }
+        offsets.push_back(block.first);
+    }
+
+    {
+        BlockLockTable::BatchGuard guard(locks, offsets, false);
+        for (auto &block : blocks) {
+            memcpy(base + block.first, block.second, BLOCK_SIZE);
+            if (tree) {
+                tree->invalidate(block.first);
+            }
+        }
+    }
+
+    // The whole batch is flushed together
+    std::vector<uint64_t> pages;
+    for (auto offset : offsets) pages_for(offset, pages);
+    after_write(pages);
+}
+
+void MmapFileStorage::read_batch(const std::vector<std::pair<uint64_t, char *>> &blocks) {
+    std::vector<uint64_t> offsets;
+    for (auto &block : blocks) {
+        if (!in_range(block.first)) {
+            FileStorage::read_batch(blocks);
+            return;
+        }
+        offsets.push_back(block.first);
+    }
+
+    BlockLockTable::BatchGuard guard(locks, offsets, true);
+    for (auto &block : blocks) {
+        memcpy(block.second, base + block.first, BLOCK_SIZE);
+    }
+}
+
+void MmapFileStorage::read_data(uint64_t offset, char *out) {
+    if (!in_range(offset)) {
+        FileStorage::read_data(offset, out);
+        return;
+    }
+
+    BlockLockTable::ReadGuard guard(locks, offset);
+    memcpy(out, base + offset, BLOCK_SIZE);
+}
+
+void MmapFileStorage::write_extent(uint64_t offset, const std::vector<iovec> &iov) {
+    auto offsets = extent_blocks(offset, iov);
+    if (offsets.empty()) return;
+    if (!in_range(offsets.back())) {
+        FileStorage::write_extent(offset, iov);
+        return;
+    }
+
+    {
+        BlockLockTable::BatchGuard guard(locks, offsets, false);
+        auto dest = base + offset;
+        for (auto &v : iov) {
+            memcpy(dest, v.iov_base, v.iov_len);
+            dest += v.iov_len;
+        }
+        if (tree) {
+            for (auto block : offsets) tree->invalidate(block);
+        }
+    }
+
+    std::vector<uint64_t> pages;
+    for (auto block : offsets) pages_for(block, pages);
+    after_write(pages);
+}
+
+void MmapFileStorage::read_extent(uint64_t offset, const std::vector<iovec> &iov) {
+    auto offsets = extent_blocks(offset, iov);
+    if (offsets.empty()) return;
+    if (!in_range(offsets.back())) {
+        FileStorage::read_extent(offset, iov);
+        return;
+    }
+
+    BlockLockTable::BatchGuard guard(locks, offsets, true);
+    auto src = base + offset;
+    for (auto &v : iov) {
+        memcpy(v.iov_base, src, v.iov_len);
+        src += v.iov_len;
+    }
+}
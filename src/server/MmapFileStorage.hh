@@ -0,0 +1,75 @@
+#ifndef MMAPFILESTORAGE_HH
+#define MMAPFILESTORAGE_HH
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FileStorage.hh"
+
+using std::string;
+
+// Number of written blocks to accumulate before msyncing them (MsyncPolicy::Batch)
+#define MSYNC_BATCH_BLOCKS 64
+// Interval between background flushes: of the whole mapping (MsyncPolicy::Periodic),
+// or of a batch that has not filled up (MsyncPolicy::Batch)
+#define MSYNC_INTERVAL_MS 100
+
+enum MsyncPolicy {
+    // msync the written range before write_data returns
+    PerWrite,
+    // msync written ranges together once MSYNC_BATCH_BLOCKS have accumulated,
+    // or within MSYNC_INTERVAL_MS if fewer are written
+    Batch,
+    // msync the whole mapping every MSYNC_INTERVAL_MS on a background thread
+    Periodic,
+};
+
+// FileStorage backend that maps the whole volume into memory.
+// Reads and writes are memcpys against the mapping (under the same block stripe
+// locks as the pread/pwrite path); durability is provided by msync according to
+// the configured policy. Only PerWrite guarantees a write is on disk when
+// write_data returns.
+class MmapFileStorage : public FileStorage {
+    MsyncPolicy policy;
+    char *base = nullptr;
+    size_t length = 0;
+
+    // Page offsets written since the last batch flush
+    std::mutex batchMutex;
+    std::vector<uint64_t> pendingPages;
+
+    std::thread flusher;
+    std::mutex flusherMutex;
+    std::condition_variable flusherCv;
+    bool stopping = false;
+
+    void unmap();
+    bool in_range(uint64_t offset);
+    void sync_range(uint64_t offset, size_t len);
+    void sync_pages(std::vector<uint64_t> &pages);
+    void pages_for(uint64_t offset, std::vector<uint64_t> &pages);
+    // Apply the msync policy to freshly written pages
+    void after_write(std::vector<uint64_t> &pages);
+    void flush_loop();
+
+   public:
+    MmapFileStorage(string fileName, MsyncPolicy policy);
+    virtual ~MmapFileStorage();
+
+    virtual void init(int fileSize) override;
+    virtual void shutdown() override;
+    virtual void write_data(uint64_t offset, const char *in) override;
+    virtual void read_data(uint64_t offset, char *out) override;
+    virtual void write_batch(const std::vector<std::pair<uint64_t, const char *>> &blocks) override;
+    virtual void read_batch(const std::vector<std::pair<uint64_t, char *>> &blocks) override;
+    virtual void write_extent(uint64_t offset, const std::vector<iovec> &iov) override;
+    virtual void read_extent(uint64_t offset, const std::vector<iovec> &iov) override;
+};
+
+#endif
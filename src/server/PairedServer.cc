@@ -21,18 +21,24 @@
 #include "../shared/CommonDefinitions.hh"
 #include "FileStorage.hh"
 #include "ReplicationModule.hh"
+#include "WriteStreamSession.hh"
+#include "ZeroBlock.hh"
 
 
 namespace fs = std::filesystem;
 using blockstorageproto::Ack;
 using blockstorageproto::BackupWriteRequest;
 using blockstorageproto::BlockStorage;
+using blockstorageproto::ExtentChunk;
+using blockstorageproto::ExtentRequest;
 using blockstorageproto::FinishSyncRequest;
 using blockstorageproto::PingMessage;
+using blockstorageproto::ReadBatchRequest;
+using blockstorageproto::ReadBatchResponse;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
-using blockstorageproto::SyncBlockRequest;
 using blockstorageproto::TriggerSyncRequest;
+using blockstorageproto::WriteBatchRequest;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
 using grpc::Channel;
@@ -51,6 +57,7 @@ using std::chrono::time_point;
 PairedServer::PairedServer(ReplState initState, FileStorage *storage, ReplicationModule *replication) : repl_state(initState), storage(storage), replication(replication)  {}
 
 Status PairedServer::Ping(ServerContext *context, const PingMessage *req, PingMessage *res) {
+    res->set_serving(SafeGetState() != ReplState::Recovering);
     return Status::OK;
 }
 
@@ -99,29 +106,257 @@ void PairedServer::BeginSynchronization(int partner_sync_id) {
 }
 void PairedServer::HandlePartnerRecovered() { }
 
+void PairedServer::WriteAsync(ServerContext *context, const WriteRequest *req, WriteResponse *res, std::function<void(Status)> done) {
+    done(Write(context, req, res));
+}
+
+void PairedServer::WriteBatchAsync(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res, std::function<void(Status)> done) {
+    done(WriteBatch(context, req, res));
+}
+
+Status PairedServer::WriteStream(ServerContext *context, ServerReaderWriter<StreamAck, StreamWrite> *stream) {
+    WriteStreamSession session(this, context, stream);
+    return session.Run();
+}
+
+Status PairedServer::CheckBatch(const WriteBatchRequest &batch) {
+    if (batch.writes_size() > BATCH_MAX_BLOCKS) {
+        return Status(StatusCode::INVALID_ARGUMENT, "Batch is limited to " + std::to_string(BATCH_MAX_BLOCKS) + " blocks");
+    }
+    // Reject the whole batch before any of it is applied
+    for (const auto &write : batch.writes()) {
+        auto check = CheckBlockSize(write.zero() ? ZeroBlock() : write.data());
+        if (!check.ok()) {
+            return check;
+        }
+    }
+    return Status::OK;
+}
+
+void PairedServer::ReadBlockLocal(uint64_t address, ReadResponse *res) {
+    storage->read_into(address, res->mutable_data());
+    if (IsZeroBlock(res->data())) {
+        res->clear_data();
+        res->set_zero(true);
+    }
+}
+
+Status PairedServer::ResolveContent(WriteBatchRequest *batch, ContentIndex *content) {
+    for (auto &write : *batch->mutable_writes()) {
+        if (write.zero()) {
+            continue;
+        }
+        if (write.has_content_hash()) {
+            auto known = content->Find(write.content_hash());
+            if (known == nullptr) {
+                return Status(StatusCode::FAILED_PRECONDITION, "unknown block content");
+            }
+            write.set_data(*known);
+        } else {
+            content->Insert(ContentIndex::Hash(write.data()), write.data());
+        }
+    }
+    return Status::OK;
+}
+
+Status PairedServer::ReadBatchLocal(const ReadBatchRequest *req, ReadBatchResponse *res) {
+    if (req->addresses_size() > BATCH_MAX_BLOCKS) {
+        return Status(StatusCode::INVALID_ARGUMENT, "Batch is limited to " + std::to_string(BATCH_MAX_BLOCKS) + " blocks");
+    }
+
+    // Read directly into the response
+    std::vector<std::pair<uint64_t, char *>> blocks;
+    for (auto address : req->addresses()) {
+        auto data = res->add_data();
+        data->resize(BLOCK_SIZE);
+        blocks.emplace_back(address, &(*data)[0]);
+    }
+    storage->read_batch(blocks);
+    return Status::OK;
+}
+
+void PairedServer::WriteBatchLocal(const WriteBatchRequest *req) {
+    std::vector<std::pair<uint64_t, const char *>> blocks;
+    for (const auto &write : req->writes()) {
+        blocks.emplace_back(write.address(), (write.zero() ? ZeroBlock() : write.data()).data());
+    }
+    storage->write_batch(blocks);
+}
+
+Status PairedServer::ReadExtentLocal(const ExtentRequest *req, ServerWriter<ExtentChunk> *writer) {
+    auto address = req->address();
+    auto remaining = req->blocks();
+    std::vector<ExtentChunk> chunks;
+    std::vector<iovec> iov;
+
+    while (remaining > 0) {
+        auto io_blocks = std::min<uint64_t>(remaining, EXTENT_IO_BLOCKS);
+
+        // One preadv fills several messages
+        chunks.clear();
+        iov.clear();
+        for (uint64_t done = 0; done < io_blocks; done += EXTENT_CHUNK_BLOCKS) {
+            auto blocks = std::min<uint64_t>(io_blocks - done, EXTENT_CHUNK_BLOCKS);
+            chunks.emplace_back();
+            chunks.back().set_address(address + done * BLOCK_SIZE);
+            chunks.back().mutable_data()->resize(blocks * BLOCK_SIZE);
+        }
+        for (auto &chunk : chunks) {
+            auto data = chunk.mutable_data();
+            iov.push_back({&(*data)[0], data->size()});
+        }
+        storage->read_extent(address, iov);
+
+        for (auto &chunk : chunks) {
+            if (!writer->Write(chunk)) {
+                return Status(StatusCode::CANCELLED, "client went away");
+            }
+        }
+        address += io_blocks * BLOCK_SIZE;
+        remaining -= io_blocks;
+    }
+    return Status::OK;
+}
+
+Status PairedServer::ReceiveExtent(ServerReaderInterface<ExtentChunk> *reader, std::function<void(std::vector<ExtentChunk> &)> apply) {
+    std::vector<ExtentChunk> run;
+    size_t runBytes = 0;
+    ExtentChunk chunk;
+
+    while (reader->Read(&chunk)) {
+        auto size = chunk.data().size();
+        if (size == 0 || size % BLOCK_SIZE != 0 || size > EXTENT_IO_BLOCKS * BLOCK_SIZE) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Extent chunks should hold 1 to " + std::to_string(EXTENT_IO_BLOCKS) + " whole blocks (was " + std::to_string(size) + " bytes)");
+        }
+
+        bool contiguous = !run.empty() && chunk.address() == run.back().address() + run.back().data().size();
+        if (!run.empty() && (!contiguous || runBytes + size > EXTENT_IO_BLOCKS * BLOCK_SIZE)) {
+            apply(run);
+            run.clear();
+            runBytes = 0;
+        }
+        runBytes += size;
+        run.push_back(std::move(chunk));
+        chunk.Clear();
+    }
+
+    if (!run.empty()) {
+        apply(run);
+    }
+    return Status::OK;
+}
+
+void PairedServer::WriteExtentLocal(std::vector<ExtentChunk> &run) {
+    std::vector<iovec> iov;
+    for (auto &chunk : run) {
+        iov.push_back({const_cast<char *>(chunk.data().data()), chunk.data().size()});
+    }
+    storage->write_extent(run.front().address(), iov);
+}
+
+std::vector<uint64_t> PairedServer::RunBlocks(const std::vector<ExtentChunk> &run) {
+    std::vector<uint64_t> blocks;
+    for (auto &chunk : run) {
+        for (size_t done = 0; done < chunk.data().size(); done += BLOCK_SIZE) {
+            blocks.push_back(chunk.address() + done);
+        }
+    }
+    return blocks;
+}
+
+Status PairedServer::CheckBlockSize(const string &data) {
+    if (data.length() != BLOCK_SIZE) {
+        return Status(StatusCode::INVALID_ARGUMENT, "Block size should be " + std::to_string(BLOCK_SIZE) + " (was " + std::to_string(data.length()) + ")");
+    }
+    return Status::OK;
+}
+
 ReplState PairedServer::SafeGetState() {
     std::shared_lock lock(stateMutex);
     return repl_state;
 }
 
 // Received while this node is recovering
-Status PairedServer::SyncBlock(ServerContext *context, const SyncBlockRequest *req, Ack *res) {
+Status PairedServer::SyncStream(ServerContext *context, ServerReader<SyncFrame> *reader, Ack *res) {
     if (SafeGetState() != ReplState::Recovering) {
-        // If received in another mode, this req must be stale
+        // If received in another mode, this sync must be stale
         return Status(StatusCode::CANCELLED, "stale sync");
     }
 
-    std::unique_lock lock(recoveryMutex);
-    if (req->sync_id() != recovery.sync_id) {
-        // This req is probably from an earlier sync, so cancel it
-        return Status(StatusCode::CANCELLED, "stale sync");
+    // The partner syncs over several of these at once, each covering its own
+    // blocks, so they are applied in parallel and only the counting is shared
+    SyncFrame frame;
+    // Mirrors the sender's index for this stream
+    ContentIndex content;
+    while (reader->Read(&frame)) {
+        {
+            std::lock_guard lock(recoveryMutex);
+            if (frame.sync_id() != recovery.sync_id) {
+                // This stream is probably from an earlier sync, so cancel it
+                return Status(StatusCode::CANCELLED, "stale sync");
+            }
+        }
+
+        auto check = ResolveContent(frame.mutable_blocks(), &content);
+        if (!check.ok()) {
+            return check;
+        }
+        check = CheckBatch(frame.blocks());
+        if (!check.ok()) {
+            return check;
+        }
+
+        // One commit per frame
+        WriteBatchLocal(&frame.blocks());
+
+        // Count the frame only toward the sync it was sent for
+        std::lock_guard lock(recoveryMutex);
+        if (frame.sync_id() != recovery.sync_id) {
+            return Status(StatusCode::CANCELLED, "stale sync");
+        }
+        recovery.blocks_received += frame.blocks().writes_size();
+        recovery.last_progress = steady_clock::now();
     }
+    return Status::OK;
+}
 
-    // Commit this block
-    storage->write_data(req->address(), req->data().c_str());
-    recovery.blocks_received += 1;
-    recovery.last_progress = steady_clock::now();
+// Sent by a partner that is about to sync to us, to narrow down what it sends
+Status PairedServer::CompareTree(ServerContext *context, const CompareTreeRequest *req, CompareTreeResponse *res) {
+    auto tree = storage->get_hash_tree();
+    if (tree == nullptr) {
+        return Status(StatusCode::UNIMPLEMENTED, "no hash tree");
+    }
+    if (req->levels() != (uint32_t)tree->levels() || req->level() >= req->levels() || req->nodes_size() != req->hashes_size()) {
+        return Status(StatusCode::INVALID_ARGUMENT, "hash tree shape mismatch");
+    }
+    int level = req->level();
+    for (auto node : req->nodes()) {
+        if (node >= tree->node_count(level)) {
+            return Status(StatusCode::INVALID_ARGUMENT, "hash tree node out of range");
+        }
+    }
+
+    if (!tree->ready()) {
+        // Still hashing the volume at startup, which could take a while, so
+        // don't wait for it: call everything different and let the partner send it
+        for (auto node : req->nodes()) {
+            res->add_differing(node);
+        }
+    } else {
+        // Cheap unless writes have landed since the last call
+        storage->refresh_hash_tree();
+        for (int i = 0; i < req->nodes_size(); i++) {
+            if (tree->node(level, req->nodes(i)) != req->hashes(i)) {
+                res->add_differing(req->nodes(i));
+            }
+        }
+    }
 
+    if (SafeGetState() == ReplState::Recovering) {
+        // The partner is working on our sync, so don't give up on it
+        std::unique_lock lock(recoveryMutex);
+        recovery.last_progress = steady_clock::now();
+    }
     return Status::OK;
 }
 
@@ -157,6 +392,9 @@ Status PairedServer::FinishSync(ServerContext *context, const FinishSyncRequest
     cout << "Finished recovery ( " << recovery.blocks_received << " blocks received)" << endl;
     std::unique_lock lock_state(stateMutex);
     repl_state = ReplState::Normal;
+    // We now match the partner, so nothing left in our own map (such as the
+    // every-block map of a volume that had none) is owed to it
+    replication->ClearDirty();
     return Status::OK;
 }
 
@@ -19,6 +19,7 @@
 
 #include "../cmake/build/blockstorage.grpc.pb.h"
 #include "../shared/CommonDefinitions.hh"
+#include "ContentIndex.hh"
 #include "FileStorage.hh"
 #include "ReplicationModule.hh"
 #include "Crash.hh"
@@ -27,13 +28,24 @@ namespace fs = std::filesystem;
 using blockstorageproto::Ack;
 using blockstorageproto::BackupWriteRequest;
 using blockstorageproto::BlockStorage;
+using blockstorageproto::CompareTreeRequest;
+using blockstorageproto::CompareTreeResponse;
+using blockstorageproto::ExtentChunk;
+using blockstorageproto::ExtentRequest;
 using blockstorageproto::FinishSyncRequest;
 using blockstorageproto::PingMessage;
+using blockstorageproto::ReadBatchRequest;
+using blockstorageproto::ReadBatchResponse;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
-using blockstorageproto::SyncBlockRequest;
+using blockstorageproto::ReplicationAck;
+using blockstorageproto::ReplicationBatch;
+using blockstorageproto::StreamAck;
+using blockstorageproto::StreamWrite;
+using blockstorageproto::SyncFrame;
 using blockstorageproto::TriggerSyncRequest;
 using blockstorageproto::HeartbeatMessage;
+using blockstorageproto::WriteBatchRequest;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
 using grpc::Channel;
@@ -41,6 +53,10 @@ using grpc::ClientContext;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerReader;
+using grpc::ServerReaderInterface;
+using grpc::ServerReaderWriter;
+using grpc::ServerWriter;
 using grpc::Status;
 using std::cout;
 using std::endl;
@@ -50,6 +66,12 @@ using std::chrono::time_point;
 
 #define RECOVERY_TIMEOUT_MS 10000
 #define RECOVERY_CHECK_INTERVAL_MS 100
+// Largest ReadBatch/WriteBatch accepted (keeps messages well under gRPC's 4MB default)
+#define BATCH_MAX_BLOCKS 256
+// Blocks per ReadExtent message
+#define EXTENT_CHUNK_BLOCKS 64
+// Blocks per preadv/pwritev on the extent paths; also the largest chunk accepted
+#define EXTENT_IO_BLOCKS 256
 
 enum ReplState {
     Normal,
@@ -79,8 +101,11 @@ class PairedServer : public BlockStorage::Service {
     virtual void BeginSynchronization(int partner_sync_id);
     virtual Status Ping(ServerContext *context, const PingMessage *req, PingMessage *res) override;
     virtual Status TriggerSync(ServerContext *context, const TriggerSyncRequest *req, Ack *res) override;
-    virtual Status SyncBlock(ServerContext *context, const SyncBlockRequest *req, Ack *res) override;
     virtual Status FinishSync(ServerContext *context, const FinishSyncRequest *req, Ack *res) override;
+    virtual Status SyncStream(ServerContext *context, ServerReader<SyncFrame> *reader, Ack *res) override;
+    virtual Status CompareTree(ServerContext *context, const CompareTreeRequest *req, CompareTreeResponse *res) override;
+    // Pipelined writes; each one goes through WriteAsync, so this serves both roles
+    virtual Status WriteStream(ServerContext *context, ServerReaderWriter<StreamAck, StreamWrite> *stream) override;
 
     FileStorage *storage;
     ReplicationModule *replication;
@@ -93,6 +118,29 @@ class PairedServer : public BlockStorage::Service {
     
     virtual void HandlePartnerRecovered();
     
+    // Sanity check for block payloads received over the wire
+    static Status CheckBlockSize(const string &data);
+    static Status CheckBatch(const WriteBatchRequest &batch);
+    // Fill in blocks sent by content hash and remember the ones sent in full,
+    // in order, keeping `content` in step with the sender's index
+    static Status ResolveContent(WriteBatchRequest *batch, ContentIndex *content);
+
+    // Read a block straight into a response, flagging it instead if it's all zeros
+    void ReadBlockLocal(uint64_t address, ReadResponse *res);
+
+    // Run a batch against local storage as one unit
+    Status ReadBatchLocal(const ReadBatchRequest *req, ReadBatchResponse *res);
+    void WriteBatchLocal(const WriteBatchRequest *req);
+
+    // Stream an extent from local storage, reading straight into the outgoing messages
+    Status ReadExtentLocal(const ExtentRequest *req, ServerWriter<ExtentChunk> *writer);
+    // Read an extent stream, handing each contiguous run of chunks (up to
+    // EXTENT_IO_BLOCKS blocks) to `apply` as it completes
+    Status ReceiveExtent(ServerReaderInterface<ExtentChunk> *reader, std::function<void(std::vector<ExtentChunk> &)> apply);
+    // Write a run of contiguous chunks with one vectored write
+    void WriteExtentLocal(std::vector<ExtentChunk> &run);
+    static std::vector<uint64_t> RunBlocks(const std::vector<ExtentChunk> &run);
+    
 
    public:
     PairedServer(ReplState initState, FileStorage *storage, ReplicationModule *replication);
@@ -100,6 +148,13 @@ class PairedServer : public BlockStorage::Service {
     virtual ~PairedServer() {}
     virtual void WaitForCounterpart();
     virtual void Recover();
+
+    // Write entry point for the async server. `done` is called exactly once,
+    // possibly on another thread, when the response can be sent.
+    // By default this runs Write to completion on the calling thread.
+    virtual void WriteAsync(ServerContext *context, const WriteRequest *req, WriteResponse *res, std::function<void(Status)> done);
+    // Likewise for WriteBatch
+    virtual void WriteBatchAsync(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res, std::function<void(Status)> done);
 };
 
 #endif
\ No newline at end of file
@@ -6,9 +6,11 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <atomic>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <memory>
@@ -31,7 +33,6 @@ using blockstorageproto::HeartbeatMessage;
 using blockstorageproto::PingMessage;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
-using blockstorageproto::SyncBlockRequest;
 using blockstorageproto::TriggerSyncRequest;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
@@ -72,37 +73,36 @@ Status PrimaryServer::Read(ServerContext *context, const ReadRequest *req, ReadR
     }
 
     // If we're functioning normally or standalone, perform the read
-    char buffer[BLOCK_SIZE];
-    storage->read_data(req->address(), buffer);
-    res->set_data(string(buffer, BLOCK_SIZE));
+    ReadBlockLocal(req->address(), res);
     return Status::OK;
 }
 
 Status PrimaryServer::Write(ServerContext *context, const WriteRequest *req, WriteResponse *res) {
-    if (SafeGetState() == ReplState::Recovering) {
-        // Redirect client to the backup while we're recovering
-        return Status(StatusCode::ABORTED, "switch nodes");
-    }
+    // Block until the write has been handled by the async path
+    std::promise<Status> result;
+    WriteAsync(context, req, res, [&result](Status status) { result.set_value(status); });
+    return result.get_future().get();
+}
 
-    auto data_str = req->data();
+void PrimaryServer::WriteAsync(ServerContext *context, const WriteRequest *req, WriteResponse *res, std::function<void(Status)> done) {
+    const auto &data = req->data();
 
     // Sanity check
-    if (data_str.length() != BLOCK_SIZE) {
-        return Status(StatusCode::INVALID_ARGUMENT, "Block size should be " + std::to_string(BLOCK_SIZE) + " (was " + std::to_string(data_str.length()) + ")");
+    auto check = CheckBlockSize(data);
+    if (!check.ok()) {
+        done(check);
+        return;
     }
 
     auto address = req->address();
-    auto data = data_str.c_str();
-
-    // Persist data locally before sending to backup
-    storage->write_data(address, data);
-    
 
 #ifdef INCLUDE_CRASH_POINTS
     if (address == PREP_CRASH_ON_MESSAGE_PRIMARY) {
         crash_flag = true;
     } else if (crash_flag) {
         if(address == CRASH_PRIMARY_BEFORE_BACKUP) {
+            // Persisted locally but never sent to the backup
+            storage->write_from(address, data);
             crash();
         } else if (address == PREP_CRASH_ON_NEXT_RECOVER) {
             make_crash_sentinel();
@@ -110,39 +110,221 @@ Status PrimaryServer::Write(ServerContext *context, const WriteRequest *req, Wri
     }
 #endif
 
-    BackupIfPossible(address, data);
-
+    // Reply once both the local persist and the backup are done, whichever finishes last.
+    // A failed local write is recorded before its countdown, so the last one reports it.
+    auto remaining = std::make_shared<std::atomic<int>>(2);
+    auto failure = std::make_shared<string>();
+    auto finish = [this, address, remaining, failure, done] {
+        if (--*remaining > 0) {
+            return;
+        }
+        if (!failure->empty()) {
+            done(Status(StatusCode::INTERNAL, *failure));
+            return;
+        }
 #ifdef INCLUDE_CRASH_POINTS
-    if (crash_flag && address == CRASH_PRIMARY_AFTER_WRITE) {
-        crash_after(1);
-    }
+        if (crash_flag && address == CRASH_PRIMARY_AFTER_WRITE) {
+            crash_after(1);
+        }
 #endif
+        done(Status::OK);
+    };
 
-    return Status::OK;
+    {
+        std::shared_lock lock(stateMutex);
+        if (repl_state == ReplState::Recovering) {
+            // Redirect client to the backup while we're recovering
+            lock.unlock();
+            done(Status(StatusCode::ABORTED, "switch nodes"));
+            return;
+        }
+
+        // Send to the backup first so the RPC is in flight while we persist locally.
+        // When Standalone, this records the block as dirty before it changes.
+        BackupIfPossible(address, data, finish);
+        try {
+            storage->write_from(address, data);
+        } catch (const std::exception &e) {
+            // The backup is already under way, so fail through the countdown rather than unwinding
+            *failure = string("local write failed: ") + e.what();
+        }
+        if (repl_state == ReplState::Standalone) {
+            // A sync under way may have taken the block before the write landed
+            replication->MarkDirty(address);
+        }
+    }
+    finish();
 }
 
-void PrimaryServer::BackupIfPossible(uint64_t address, const char *data) {
+void PrimaryServer::BackupIfPossible(uint64_t address, const string &data, std::function<void()> done) {
+    switch (repl_state) {
+        case ReplState::Normal:
+            // The callback only takes the write lock once our caller has released the read lock
+            replication->SendBackupWriteAsync(address, data, [this, address, done](bool ok) {
+                if (!ok) {
+                    // If we fail the req, assume the backup has crashed and go to Standalone
+                    cout << "Backup appears to be down; switching to Standalone" << endl;
+                    std::unique_lock lock0(stateMutex);
+                    repl_state = ReplState::Standalone;
+                    replication->MarkDirty(address);
+                }
+                done();
+            });
+            return;
+        case ReplState::Standalone:
+            // A sync in progress can't finish until our caller releases the read lock
+            replication->MarkDirty(address);
+            done();
+            return;
+        case ReplState::Recovering:
+            throw std::runtime_error("Attempting to send backup while in recovery (should never happen)");
+    }
+}
+
+Status PrimaryServer::ReadBatch(ServerContext *context, const ReadBatchRequest *req, ReadBatchResponse *res) {
+    if (SafeGetState() == ReplState::Recovering) {
+        // Redirect client to the backup while we're recovering
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+    return ReadBatchLocal(req, res);
+}
+
+Status PrimaryServer::WriteBatch(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res) {
+    std::promise<Status> result;
+    WriteBatchAsync(context, req, res, [&result](Status status) { result.set_value(status); });
+    return result.get_future().get();
+}
+
+void PrimaryServer::WriteBatchAsync(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res, std::function<void(Status)> done) {
+    if (SafeGetState() == ReplState::Recovering) {
+        // Redirect client to the backup while we're recovering
+        done(Status(StatusCode::ABORTED, "switch nodes"));
+        return;
+    }
+
+    auto check = CheckBatch(*req);
+    if (!check.ok()) {
+        done(check);
+        return;
+    }
+
     std::shared_lock lock(stateMutex);
     switch (repl_state) {
         case ReplState::Normal:
+            // Persist the whole batch locally, then replicate it as one message
+            WriteBatchLocal(req);
             lock.unlock();  // Release the read lock before making an RPC call
-            if (!replication->TrySendBackupWrite(address, data)) {
-                // If we fail the req, assume the backup has crashed and go to Standalone
-                cout << "Backup appears to be down; switching to Standalone" << endl;
-                std::unique_lock lock0(stateMutex);
-                repl_state = ReplState::Standalone;
-                replication->MarkDirty(address);
-            }
+            // The request outlives the RPC, since we only finish the call from its completion
+            replication->SendBackupWriteBatchAsync(req, [this, req, done](bool ok) {
+                if (!ok) {
+                    cout << "Backup appears to be down; switching to Standalone" << endl;
+                    std::unique_lock lock0(stateMutex);
+                    repl_state = ReplState::Standalone;
+                    for (const auto &write : req->writes()) {
+                        replication->MarkDirty(write.address());
+                    }
+                }
+                done(Status::OK);
+            });
             return;
-        case ReplState::Standalone:
+        case ReplState::Standalone: {
             // Hold the read lock, in case a sync is in progress
-            replication->MarkDirty(address);
+            std::vector<uint64_t> addresses;
+            for (const auto &write : req->writes()) {
+                addresses.push_back(write.address());
+            }
+            replication->WriteDirty(addresses, [&] { WriteBatchLocal(req); });
+            lock.unlock();
+            done(Status::OK);
             return;
+        }
         case ReplState::Recovering:
             throw std::runtime_error("Attempting to send backup while in recovery (should never happen)");
     }
 }
 
+Status PrimaryServer::BackupWriteBatch(ServerContext *context, const WriteBatchRequest *req, Ack *res) {
+    // Primary should never receive these
+    return Status(StatusCode::FAILED_PRECONDITION, "invalid target");
+}
+
+Status PrimaryServer::ReadExtent(ServerContext *context, const ExtentRequest *req, ServerWriter<ExtentChunk> *writer) {
+    if (SafeGetState() == ReplState::Recovering) {
+        // Redirect client to the backup while we're recovering
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+    return ReadExtentLocal(req, writer);
+}
+
+Status PrimaryServer::WriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, WriteResponse *res) {
+    if (SafeGetState() == ReplState::Recovering) {
+        // Redirect client to the backup while we're recovering
+        return Status(StatusCode::ABORTED, "switch nodes");
+    }
+
+    // The extent is replicated over one BackupWriteExtent stream, which the backup
+    // applies run by run and confirms when we close it. Until then, everything
+    // sent on it has to be resynced if the stream fails.
+    std::unique_ptr<ReplicationModule::ExtentSender> backup;
+    std::vector<uint64_t> streamed;
+
+    auto status = ReceiveExtent(reader, [&](std::vector<ExtentChunk> &run) {
+        auto blocks = RunBlocks(run);
+
+        std::shared_lock lock(stateMutex);
+        switch (repl_state) {
+            case ReplState::Normal: {
+                lock.unlock();  // Release the read lock before making an RPC call
+                WriteExtentLocal(run);
+                if (!backup) {
+                    backup = replication->OpenBackupExtent();
+                    streamed.clear();
+                }
+                streamed.insert(streamed.end(), blocks.begin(), blocks.end());
+                bool ok = true;
+                for (auto &chunk : run) {
+                    ok = ok && backup->Send(chunk);
+                }
+                if (!ok) {
+                    backup.reset();
+                    BackupFailed(streamed);
+                }
+                return;
+            }
+            case ReplState::Standalone:
+                // Hold the read lock, in case a sync is in progress
+                replication->WriteDirty(blocks, [&] { WriteExtentLocal(run); });
+                return;
+            case ReplState::Recovering:
+                throw std::runtime_error("Attempting to send backup while in recovery (should never happen)");
+        }
+    });
+
+    if (backup && !backup->Finish()) {
+        BackupFailed(streamed);
+    }
+    return status;
+}
+
+void PrimaryServer::BackupFailed(const std::vector<uint64_t> &addresses) {
+    cout << "Backup appears to be down; switching to Standalone" << endl;
+    std::unique_lock lock(stateMutex);
+    repl_state = ReplState::Standalone;
+    for (auto address : addresses) {
+        replication->MarkDirty(address);
+    }
+}
+
+Status PrimaryServer::BackupWriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, Ack *res) {
+    // Primary should never receive these
+    return Status(StatusCode::FAILED_PRECONDITION, "invalid target");
+}
+
+Status PrimaryServer::Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch> *stream) {
+    // Primary should never receive these
+    return Status(StatusCode::FAILED_PRECONDITION, "invalid target");
+}
+
 Status PrimaryServer::BackupWrite(ServerContext *context, const BackupWriteRequest *req, Ack *res) {
     // Primary should never receive these
     return Status(StatusCode::FAILED_PRECONDITION, "invalid target");
@@ -8,6 +8,7 @@
 #include <time.h>
 
 #include <exception>
+#include <functional>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
@@ -49,11 +50,25 @@ class PrimaryServer : public PairedServer {
     virtual Status Read(ServerContext *context, const ReadRequest *req, ReadResponse *res) override;
     virtual Status Write(ServerContext *context, const WriteRequest *req, WriteResponse *res) override;
     virtual Status BackupWrite(ServerContext *context, const BackupWriteRequest *req, Ack *res) override;
+    virtual Status ReadBatch(ServerContext *context, const ReadBatchRequest *req, ReadBatchResponse *res) override;
+    virtual Status WriteBatch(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res) override;
+    virtual Status BackupWriteBatch(ServerContext *context, const WriteBatchRequest *req, Ack *res) override;
+    virtual Status ReadExtent(ServerContext *context, const ExtentRequest *req, ServerWriter<ExtentChunk> *writer) override;
+    virtual Status WriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, WriteResponse *res) override;
+    virtual Status BackupWriteExtent(ServerContext *context, ServerReader<ExtentChunk> *reader, Ack *res) override;
+    virtual Status Replicate(ServerContext *context, ServerReaderWriter<ReplicationAck, ReplicationBatch> *stream) override;
 
-    void BackupIfPossible(uint64_t address, const char *data);
+    // Start replicating a write, or mark it dirty if the backup is unavailable; calls `done` once handled.
+    // The caller holds the read lock on stateMutex until the block is persisted locally, so nothing
+    // can mark the block dirty or finish a resync before it is on disk.
+    void BackupIfPossible(uint64_t address, const string &data, std::function<void()> done);
+    // The backup failed to take these writes: go Standalone and remember them for the resync
+    void BackupFailed(const std::vector<uint64_t> &addresses);
     
     public:
         PrimaryServer(ReplState initState, FileStorage *storage, ReplicationModule *replication);
+        virtual void WriteAsync(ServerContext *context, const WriteRequest *req, WriteResponse *res, std::function<void(Status)> done) override;
+        virtual void WriteBatchAsync(ServerContext *context, const WriteBatchRequest *req, WriteResponse *res, std::function<void(Status)> done) override;
     
 };
 
@@ -0,0 +1,169 @@
+#include "ReplicationChannel.hh"
+
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using blockstorageproto::BlockStorage;
+using blockstorageproto::ReplicationAck;
+using blockstorageproto::ReplicationBatch;
+using std::cout;
+using std::endl;
+using std::chrono::steady_clock;
+
+ReplicationChannel::ReplicationChannel(BlockStorage::Stub *stub, bool compress) : stub(stub), compress(compress) {}
+
+void ReplicationChannel::Send(uint64_t address, const std::string &data, std::function<void(bool)> done) {
+    // Look at the block before taking the lock, so concurrent senders do this in parallel
+    bool zero = IsZeroBlock(data);
+    uint64_t hash = zero ? 0 : ContentIndex::Hash(data);
+    {
+        std::lock_guard lock(mtx);
+        if (!session || session->failed) {
+            // The sender opens the call, so a slow connect never holds up the caller
+            session = std::make_shared<Session>();
+            std::thread(&ReplicationChannel::RunSender, this, session).detach();
+        }
+        std::string buffer;
+        if (!zero) {
+            if (!spareBuffers.empty()) {
+                buffer = std::move(spareBuffers.back());
+                spareBuffers.pop_back();
+            }
+            buffer.assign(data);
+        }
+        session->queued.push_back({nextSeq++, address, std::move(buffer), zero, hash, std::move(done), {}});
+    }
+    cv.notify_all();
+}
+
+void ReplicationChannel::RunSender(std::shared_ptr<Session> s) {
+    s->stream = stub->Replicate(&s->context);
+    std::thread(&ReplicationChannel::RunReceiver, this, s).detach();
+
+    auto timeout = std::chrono::milliseconds(REPLICATION_ACK_TIMEOUT_MS);
+    // Cleared rather than rebuilt for each send, so its entries keep their buffers
+    ReplicationBatch batch;
+    std::unique_lock lock(mtx);
+    while (!s->failed) {
+        cv.wait_for(lock, timeout, [&] { return s->failed || (!s->queued.empty() && s->inFlight.size() < REPLICATION_WINDOW); });
+        if (s->failed) {
+            break;
+        }
+        if (!s->unacked.empty() && steady_clock::now() - s->unacked.front().sent > timeout) {
+            cout << "Backup has not acknowledged write " << s->unacked.front().seq << " in " << REPLICATION_ACK_TIMEOUT_MS << "ms; dropping the replication stream" << endl;
+            s->context.TryCancel();
+            break;
+        }
+        if (s->queued.empty() || s->inFlight.size() >= REPLICATION_WINDOW) {
+            continue;
+        }
+
+        // Everything queued so far goes out together
+        batch.Clear();
+        batch.set_first_seq(s->queued.front().seq);
+        auto now = steady_clock::now();
+        // Blocks carried in full, and how many of those look compressible
+        int carried = 0;
+        int worth = 0;
+        while (!s->queued.empty() && batch.writes().writes_size() < REPLICATION_BATCH_BLOCKS) {
+            auto &write = s->queued.front();
+            auto entry = batch.mutable_writes()->add_writes();
+            entry->set_address(write.address);
+            auto known = write.zero ? nullptr : s->content.Find(write.hash);
+            if (write.zero) {
+                entry->set_zero(true);
+            } else if (known != nullptr && *known == write.data) {
+                // Already sent on this stream, so the backup has it
+                entry->set_content_hash(write.hash);
+                if (write.data.capacity() >= BLOCK_SIZE) {
+                    spareBuffers.push_back(std::move(write.data));
+                }
+            } else {
+                s->content.Insert(write.hash, write.data);
+                carried++;
+                if (compress) {
+                    worth += WorthCompressing(write.data);
+                }
+                // Trade the payload for the buffer this entry carried last time
+                entry->mutable_data()->swap(write.data);
+                if (write.data.capacity() >= BLOCK_SIZE) {
+                    spareBuffers.push_back(std::move(write.data));
+                }
+            }
+            write.sent = now;
+            s->unacked.push_back(std::move(write));
+            s->queued.pop_front();
+        }
+        s->inFlight.push_back(s->unacked.back().seq);
+        grpc::WriteOptions options;
+        if (compress && worth * 2 < carried) {
+            options.set_no_compression();
+        }
+
+        lock.unlock();
+        bool ok = s->stream->Write(batch, options);
+        lock.lock();
+        if (!ok) {
+            // The receiver sees the call end and fails what is left
+            s->context.TryCancel();
+            break;
+        }
+    }
+    s->senderDone = true;
+    lock.unlock();
+    cv.notify_all();
+}
+
+void ReplicationChannel::RunReceiver(std::shared_ptr<Session> s) {
+    ReplicationAck ack;
+    std::vector<Write> done;
+
+    while (s->stream->Read(&ack)) {
+        {
+            std::lock_guard lock(mtx);
+            while (!s->unacked.empty() && s->unacked.front().seq <= ack.seq()) {
+                done.push_back(std::move(s->unacked.front()));
+                s->unacked.pop_front();
+            }
+            while (!s->inFlight.empty() && s->inFlight.front() <= ack.seq()) {
+                s->inFlight.pop_front();
+            }
+        }
+        cv.notify_all();
+        for (auto &write : done) {
+            write.done(true);
+        }
+        done.clear();
+    }
+
+    // Stop the sender, and wait for it to let go of the stream before finishing the call
+    s->context.TryCancel();
+    std::unique_lock lock(mtx);
+    s->failed = true;
+    cv.notify_all();
+    cv.wait(lock, [&] { return s->senderDone; });
+    lock.unlock();
+
+    auto status = s->stream->Finish();
+    cout << "Replication stream closed: " << status.error_message() << endl;
+
+    lock.lock();
+    for (auto &write : s->unacked) {
+        done.push_back(std::move(write));
+    }
+    for (auto &write : s->queued) {
+        done.push_back(std::move(write));
+    }
+    s->unacked.clear();
+    s->queued.clear();
+    if (session == s) {
+        session.reset();
+    }
+    lock.unlock();
+
+    for (auto &write : done) {
+        write.done(false);
+    }
+}
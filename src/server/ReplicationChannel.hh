@@ -0,0 +1,92 @@
+#ifndef REPLICATIONCHANNEL_HH
+#define REPLICATIONCHANNEL_HH
+
+#include <grpcpp/grpcpp.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../cmake/build/blockstorage.grpc.pb.h"
+#include "../shared/CommonDefinitions.hh"
+#include "ContentIndex.hh"
+#include "WireCompression.hh"
+#include "ZeroBlock.hh"
+
+// Most writes carried by one Replicate message (the backup accepts up to BATCH_MAX_BLOCKS)
+#define REPLICATION_BATCH_BLOCKS 256
+// Replicate messages sent ahead of the backup's acks
+#define REPLICATION_WINDOW 4
+// A write left unacknowledged this long means the backup is stuck; the stream is dropped
+#define REPLICATION_ACK_TIMEOUT_MS 5000
+
+// Replicates single writes to the backup over one long-lived Replicate stream
+// instead of one BackupWrite call each. Every write gets the next sequence number.
+// A sender thread packs whatever has queued up into a message, keeping up to
+// REPLICATION_WINDOW messages in flight, so writes that arrive while the backup
+// is busy travel and commit together. A receiver thread takes the backup's
+// cumulative acks and completes every write they cover.
+// Payloads circulate between spareBuffers, the queued writes and the sender's
+// message, which is reused from one send to the next, so a busy stream
+// allocates no payload buffers.
+// Blocks of zeros are flagged rather than sent, and a block already sent in
+// full on the same stream is sent as its content hash.
+// With compression on, a message goes out compressed only if most of its
+// blocks look like they will shrink.
+// The first error ends the stream and fails every write on it that has not been
+// acked. The next write opens a new stream.
+class ReplicationChannel {
+    struct Write {
+        uint64_t seq;
+        uint64_t address;
+        // Left empty for a block of zeros
+        std::string data;
+        bool zero;
+        // ContentIndex::Hash of data
+        uint64_t hash;
+        std::function<void(bool)> done;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    // One Replicate call
+    struct Session {
+        grpc::ClientContext context;
+        std::unique_ptr<grpc::ClientReaderWriter<blockstorageproto::ReplicationBatch, blockstorageproto::ReplicationAck>> stream;
+        std::deque<Write> queued;
+        std::deque<Write> unacked;
+        // Last sequence number of each message not yet fully acked
+        std::deque<uint64_t> inFlight;
+        // Mirrors the backup's index of the blocks sent in full on this stream
+        ContentIndex content;
+        bool failed = false;
+        bool senderDone = false;
+    };
+
+    blockstorageproto::BlockStorage::Stub *stub;
+    // Whether the stub's channel compresses, so messages that won't shrink should opt out
+    bool compress;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::shared_ptr<Session> session;
+    // Payload buffers handed back by the sender, so a write's copy of its block reuses one
+    std::vector<std::string> spareBuffers;
+    uint64_t nextSeq = 1;
+
+    void RunSender(std::shared_ptr<Session> s);
+    void RunReceiver(std::shared_ptr<Session> s);
+
+   public:
+    ReplicationChannel(blockstorageproto::BlockStorage::Stub *stub, bool compress);
+
+    // `done` runs once the backup has the write (true) or the stream carrying it failed (false)
+    void Send(uint64_t address, const std::string &data, std::function<void(bool)> done);
+};
+
+#endif
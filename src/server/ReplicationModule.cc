@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include <algorithm>
+#include <chrono>
 #include <exception>
 #include <filesystem>
 #include <fstream>
@@ -21,18 +23,22 @@
 #include "FileStorage.hh"
 #include "PairedServer.hh"
 #include "ReplicationModule.hh"
+#include "SyncWorker.hh"
 
 namespace fs = std::filesystem;
 using blockstorageproto::Ack;
-using blockstorageproto::BackupWriteRequest;
 using blockstorageproto::BlockStorage;
+using blockstorageproto::CompareTreeRequest;
+using blockstorageproto::CompareTreeResponse;
+using blockstorageproto::ExtentChunk;
 using blockstorageproto::FinishSyncRequest;
 using blockstorageproto::HeartbeatMessage;
 using blockstorageproto::PingMessage;
 using blockstorageproto::ReadRequest;
 using blockstorageproto::ReadResponse;
-using blockstorageproto::SyncBlockRequest;
+using blockstorageproto::SyncFrame;
 using blockstorageproto::TriggerSyncRequest;
+using blockstorageproto::WriteBatchRequest;
 using blockstorageproto::WriteRequest;
 using blockstorageproto::WriteResponse;
 using grpc::Channel;
@@ -48,7 +54,13 @@ using std::string;
 using std::chrono::steady_clock;
 using std::chrono::time_point;
 
-ReplicationModule::ReplicationModule(std::shared_ptr<Channel> channel) : stub_(BlockStorage::NewStub(channel)) {}
+ReplicationModule::ReplicationModule(std::shared_ptr<Channel> channel, grpc_compression_algorithm compression)
+    : dirty_((uint64_t)STORAGE_FILE_SIZE_MB * 1024 * 1024),
+      syncing_((uint64_t)STORAGE_FILE_SIZE_MB * 1024 * 1024),
+      stub_(BlockStorage::NewStub(channel)),
+      compress_(compression != GRPC_COMPRESS_NONE) {
+    channel_ = std::make_unique<ReplicationChannel>(stub_.get(), compress_);
+}
 
 void ReplicationModule::PingOnce() {
     PingMessage req;
@@ -59,6 +71,9 @@ void ReplicationModule::PingOnce() {
     // Retry w backoff
     do {
         ClientContext context;
+        // Fail-fast calls keep failing while the channel backs off from an earlier refused connect
+        context.set_wait_for_ready(true);
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
         cout << "Attempting to ping the other server..." << endl;
         status = stub_->Ping(&context, req, &res);
         if (status.ok()) {
@@ -70,31 +85,118 @@ void ReplicationModule::PingOnce() {
     cout << "Ping response received!" << endl;
 }
 
+bool ReplicationModule::PartnerServing() {
+    PingMessage req;
+    PingMessage res;
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(PARTNER_CHECK_TIMEOUT_MS));
+    auto status = stub_->Ping(&context, req, &res);
+    return status.ok() && res.serving();
+}
+
+bool ReplicationModule::PersistDirty(const std::string& fileName, bool freshVolume) {
+    dirtyFile_ = std::make_unique<DirtyMapFile>(fileName, (uint64_t)STORAGE_FILE_SIZE_MB * 1024 * 1024, dirty_.word_count());
+    std::vector<uint64_t> image;
+    bool loaded = dirtyFile_->load(&image);
+    bool owed = false;
+    if (loaded && freshVolume) {
+        // Left over from the volume that was replaced; it is overwritten below
+        cout << "Discarding dirty map of a previous volume" << endl;
+    } else if (loaded) {
+        dirty_.Load(image);
+        owed = dirty_.Count() > 0;
+        if (owed) {
+            cout << "Picked up " << dirty_.Count() << " dirty blocks to resync" << endl;
+        }
+    } else if (!freshVolume) {
+        cout << "No dirty map for existing volume; every block will be resynced" << endl;
+        dirty_.MarkAll();
+    }
+
+    dirtyFile_->start([this](std::vector<uint64_t>* image) {
+        std::lock_guard lock(snapshotMutex_);
+        dirty_.OrInto(image);
+        syncing_.OrInto(image);
+    });
+    if (loaded && freshVolume) {
+        dirtyFile_->sync();
+    }
+    return owed;
+}
+
 void ReplicationModule::MarkDirty(uint64_t address) {
-    auto r = dirtySet.emplace(address);
-    if (r.second) {
-        dirtyVec.emplace_back(address);
+    if (dirty_.Mark(address) && dirtyFile_) {
+        dirtyFile_->sync();
     }
 }
 
+void ReplicationModule::WriteDirty(const std::vector<uint64_t>& addresses, const std::function<void()>& write) {
+    // One flush covers every block the write newly dirties
+    auto mark = [&] {
+        bool fresh = false;
+        for (auto address : addresses) {
+            fresh |= dirty_.Mark(address);
+        }
+        if (fresh && dirtyFile_) {
+            dirtyFile_->sync();
+        }
+    };
+    mark();
+    write();
+    mark();
+}
+
 void ReplicationModule::ClearDirty() {
-    dirtySet.clear();
-    dirtyVec.clear();
+    dirty_.Clear();
+    syncing_.Clear();
 }
 
-bool ReplicationModule::TrySendBackupWrite(uint64_t address, const char* buffer) {
-    BackupWriteRequest req;
-    Ack res;
-    Status status;
-    ClientContext context;
+void ReplicationModule::SendBackupWriteAsync(uint64_t address, const std::string& data, std::function<void(bool)> done) {
+    channel_->Send(address, data, std::move(done));
+}
 
-    std::string data_str(buffer, BLOCK_SIZE);
+void ReplicationModule::SendBackupWriteBatchAsync(const WriteBatchRequest* batch, std::function<void(bool)> done) {
+    struct PendingBackupWriteBatch {
+        Ack res;
+        ClientContext context;
+    };
+    auto call = new PendingBackupWriteBatch();
+    if (compress_) {
+        // One message, so the blocks decide together
+        int worth = 0;
+        for (auto& write : batch->writes()) {
+            worth += WorthCompressing(write.data());
+        }
+        if (worth * 2 < batch->writes_size()) {
+            call->context.set_compression_algorithm(GRPC_COMPRESS_NONE);
+        }
+    }
 
-    req.set_address(address);
-    req.set_data(data_str);
+    stub_->async()->BackupWriteBatch(&call->context, batch, &call->res, [call, done](Status status) {
+        delete call;
+        done(status.ok());
+    });
+}
 
-    status = stub_->BackupWrite(&context, req, &res);
-    return status.ok();
+ReplicationModule::ExtentSender::ExtentSender(BlockStorage::Stub *stub, bool compress) : compress(compress) {
+    writer = stub->BackupWriteExtent(&context, &res);
+}
+
+bool ReplicationModule::ExtentSender::Send(const ExtentChunk &chunk) {
+    grpc::WriteOptions options;
+    if (compress && !WorthCompressing(chunk.data())) {
+        options.set_no_compression();
+    }
+    return writer->Write(chunk, options);
+}
+
+bool ReplicationModule::ExtentSender::Finish() {
+    writer->WritesDone();
+    return writer->Finish().ok();
+}
+
+std::unique_ptr<ReplicationModule::ExtentSender> ReplicationModule::OpenBackupExtent() {
+    return std::make_unique<ExtentSender>(stub_.get(), compress_);
 }
 
 bool ReplicationModule::TrySendTriggerSync(int sync_id) {
@@ -107,16 +209,110 @@ bool ReplicationModule::TrySendTriggerSync(int sync_id) {
     return status.ok();
 }
 
-bool ReplicationModule::TrySendSyncBlock(int sync_id, uint64_t address, char* buffer) {
-    SyncBlockRequest req;
-    Ack res;
-    Status status;
-    ClientContext context;
-    req.set_sync_id(sync_id);
-    req.set_address(address);
-    req.set_data(string(buffer, BLOCK_SIZE));
-    status = stub_->SyncBlock(&context, req, &res);
-    return status.ok();
+// The partner asked for this sync, so it is up: ride out any reconnect
+// backoff left over from its crash rather than failing fast
+static void WaitForRecoveringPartner(ClientContext &context) {
+    context.set_wait_for_ready(true);
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(RECOVERY_TIMEOUT_MS));
+}
+
+ReplicationModule::SyncSender::SyncSender(BlockStorage::Stub *stub) : progress(steady_clock::now()) {
+    // As with FinishSync, the partner is up but we may still be backing off.
+    // A sync can take a while, so the watchdog bounds the call rather than a deadline.
+    context.set_wait_for_ready(true);
+    writer = stub->SyncStream(&context, &res);
+    thread = std::thread(&SyncSender::RunWriter, this);
+}
+
+ReplicationModule::SyncSender::~SyncSender() {
+    {
+        std::lock_guard lock(mtx);
+        if (!finished) {
+            // Abandoned partway through
+            context.TryCancel();
+        }
+        closing = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void ReplicationModule::SyncSender::RunWriter() {
+    std::unique_lock lock(mtx);
+    while (true) {
+        cv.wait(lock, [&] { return !queued.empty() || closing; });
+        if (queued.empty()) {
+            break;
+        }
+        auto frame = std::move(queued.front());
+        queued.pop_front();
+
+        lock.unlock();
+        bool ok = writer->Write(frame->msg, frame->options);
+        lock.lock();
+        progress = steady_clock::now();
+        spare.push_back(std::move(frame));
+        cv.notify_all();
+        if (!ok) {
+            failed = true;
+            break;
+        }
+    }
+    lock.unlock();
+
+    // Finish reports the partner's verdict on the whole stream
+    if (!failed) {
+        writer->WritesDone();
+    }
+    auto status = writer->Finish();
+
+    lock.lock();
+    failed = failed || !status.ok();
+    finished = true;
+    cv.notify_all();
+}
+
+void ReplicationModule::SyncSender::Await(std::unique_lock<std::mutex> &lock, std::function<bool()> ready) {
+    auto timeout = std::chrono::milliseconds(RECOVERY_TIMEOUT_MS);
+    while (!cv.wait_for(lock, timeout, ready)) {
+        if (steady_clock::now() - progress > timeout) {
+            cout << "Recovering partner has not taken a sync frame in " << RECOVERY_TIMEOUT_MS << "ms; dropping the sync" << endl;
+            context.TryCancel();
+        }
+    }
+}
+
+SyncFrame *ReplicationModule::SyncSender::Next() {
+    std::unique_lock lock(mtx);
+    Await(lock, [&] { return failed || queued.size() < SYNC_STREAM_WINDOW; });
+    if (failed) {
+        return nullptr;
+    }
+    if (spare.empty()) {
+        filling = std::make_unique<Frame>();
+    } else {
+        filling = std::move(spare.back());
+        spare.pop_back();
+        filling->msg.Clear();
+    }
+    return &filling->msg;
+}
+
+void ReplicationModule::SyncSender::Send(grpc::WriteOptions options) {
+    {
+        std::lock_guard lock(mtx);
+        filling->options = options;
+        queued.push_back(std::move(filling));
+    }
+    cv.notify_all();
+}
+
+bool ReplicationModule::SyncSender::Finish() {
+    std::unique_lock lock(mtx);
+    closing = true;
+    cv.notify_all();
+    Await(lock, [&] { return finished; });
+    return !failed;
 }
 
 bool ReplicationModule::TrySendFinishSync(int sync_id, size_t block_count) {
@@ -127,42 +323,175 @@ bool ReplicationModule::TrySendFinishSync(int sync_id, size_t block_count) {
     req.set_sync_id(sync_id);
     req.set_total_blocks(block_count);
 
+    WaitForRecoveringPartner(context);
     status = stub_->FinishSync(&context, req, &res);
     return status.ok();
 }
 
-// Lock *must* be passed in an unlocked state.
-// It will return locked on success, or else in any state.
-bool ReplicationModule::TryPerformSync(int sync_id, std::unique_lock<std::shared_mutex>* lock, FileStorage* storage) {
-    size_t i = 0;
-    uint64_t address;
+bool ReplicationModule::TryCompareTree(HashTree* tree, int level, const std::vector<uint64_t>& nodes, std::vector<uint64_t>* differing) {
+    differing->clear();
+    for (size_t start = 0; start < nodes.size(); start += COMPARE_TREE_NODES) {
+        CompareTreeRequest req;
+        CompareTreeResponse res;
+        ClientContext context;
+        req.set_levels(tree->levels());
+        req.set_level(level);
+        for (size_t i = start; i < nodes.size() && i < start + COMPARE_TREE_NODES; i++) {
+            req.add_nodes(nodes[i]);
+            req.add_hashes(tree->node(level, nodes[i]));
+        }
+        // Hashes don't compress
+        context.set_compression_algorithm(GRPC_COMPRESS_NONE);
+        WaitForRecoveringPartner(context);
+        if (!stub_->CompareTree(&context, req, &res).ok()) {
+            return false;
+        }
+        differing->insert(differing->end(), res.differing().begin(), res.differing().end());
+    }
+    return true;
+}
+
+bool ReplicationModule::TryNarrowDirty(FileStorage* storage) {
+    auto tree = storage->get_hash_tree();
+    if (tree == nullptr) {
+        return false;
+    }
+
+    // Set the candidates aside, so dirty_ collects only the writes made from here on
+    {
+        std::lock_guard guard(snapshotMutex_);
+        dirty_.MoveInto(&syncing_);
+    }
+    auto candidates = syncing_.Count();
+
+    // Every write set aside above is in the tree once this returns
+    storage->refresh_hash_tree();
 
+    // Descend from the root into the children of each node that differs
+    int level = tree->levels() - 1;
+    std::vector<uint64_t> nodes;
+    std::vector<uint64_t> differing;
+    for (size_t i = 0; i < tree->node_count(level); i++) {
+        nodes.push_back(i);
+    }
+    size_t compared = 0;
     while (true) {
-        lock->lock();
-        if (i < dirtyVec.size()) {
-            address = dirtyVec[i++];
-            
-            // If we have more entries yet to process, unlock to allow more to be added
-            lock->unlock();
-        } else {
-            // If we have reached the end of the queue, break while still holding the lock
+        if (!TryCompareTree(tree, level, nodes, &differing)) {
+            std::lock_guard guard(snapshotMutex_);
+            dirty_.Merge(syncing_);
+            syncing_.Clear();
+            return false;
+        }
+        compared += nodes.size();
+        if (level == 0 || differing.empty()) {
             break;
         }
+        level--;
+        nodes.clear();
+        for (auto parent : differing) {
+            for (auto child = parent * HASH_TREE_FANOUT; child < (parent + 1) * HASH_TREE_FANOUT && child < tree->node_count(level); child++) {
+                nodes.push_back(child);
+            }
+        }
+    }
+
+    // Only blocks that were dirty to begin with; the rest the partner already has
+    size_t kept = 0;
+    {
+        std::lock_guard guard(snapshotMutex_);
+        for (auto block : differing) {
+            if (syncing_.IsMarked(block * BLOCK_SIZE)) {
+                dirty_.Mark(block * BLOCK_SIZE);
+                kept++;
+            }
+        }
+        syncing_.Clear();
+    }
+    cout << "Hash tree comparison: " << kept << " of " << candidates << " dirty blocks differ (" << compared << " nodes compared)" << endl;
+    return true;
+}
 
-        char buffer[BLOCK_SIZE];
-        storage->read_data(address, buffer);
+// Lock *must* be passed in an unlocked state.
+// It will return locked on success, or else in any state.
+bool ReplicationModule::TryPerformSync(int sync_id, std::unique_lock<std::shared_mutex>* lock, FileStorage* storage) {
+    std::lock_guard guard(syncMutex_);
+    size_t sent = 0;
+    std::vector<uint64_t> blocks;
 
-        if (!TrySendSyncBlock(sync_id, dirtyVec[i], buffer)) {
-            cout << "Failed to sync block to recovering partner" << endl;
+    // Comparing hashes costs far less than sending a large dirty set that may mostly match
+    if (dirty_.Count() >= SYNC_TREE_DIFF_BLOCKS && !TryNarrowDirty(storage)) {
+        cout << "Hash tree comparison failed; sending every dirty block" << endl;
+    }
+
+    // Each worker takes an equal slice of the volume
+    std::vector<std::unique_ptr<SyncWorker>> workers;
+    for (int w = 0; w < SYNC_WORKERS; w++) {
+        workers.push_back(std::make_unique<SyncWorker>(stub_.get(), storage, sync_id, compress_));
+    }
+    uint64_t range = ((uint64_t)STORAGE_FILE_SIZE_MB * 1024 * 1024 + SYNC_WORKERS - 1) / SYNC_WORKERS;
+
+    // Take the dirty blocks in address order and hand them to their workers
+    auto sweep = [&]() -> bool {
+        size_t cursor = 0;
+        while (true) {
+            {
+                std::lock_guard guard(snapshotMutex_);
+                if (!dirty_.Take(&cursor, &blocks, SYNC_FRAME_BLOCKS)) {
+                    return true;
+                }
+                for (auto address : blocks) {
+                    syncing_.Mark(address);
+                }
+            }
+            for (auto address : blocks) {
+                if (!workers[std::min(address / range, (uint64_t)SYNC_WORKERS - 1)]->Add(address)) {
+                    return false;
+                }
+            }
+            sent += blocks.size();
+        }
+    };
+    auto fail = [&]() {
+        cout << "Failed to sync blocks to recovering partner" << endl;
+        // Whatever this sync took is still owed to the partner
+        std::lock_guard guard(snapshotMutex_);
+        dirty_.Merge(syncing_);
+        syncing_.Clear();
+        return false;
+    };
+
+    // Writes carry on meanwhile, and a block written after it was taken is
+    // marked again; keep sweeping until a sweep only finds a few
+    size_t before;
+    do {
+        before = sent;
+        if (!sweep()) {
             // Return without lock held
-            return false;
+            return fail();
+        }
+    } while (sent - before >= SYNC_FRAME_BLOCKS);
+
+    // With writes held off, the last sweep leaves nothing behind
+    lock->lock();
+    if (!sweep()) {
+        return fail();
+    }
+
+    // Only the blocks still queued are left to go; let every worker flush at once
+    for (auto &worker : workers) {
+        worker->Close();
+    }
+    for (auto &worker : workers) {
+        if (!worker->Finish()) {
+            return fail();
         }
     }
 
     // Return with lock still held
-    auto ok = TrySendFinishSync(sync_id, i);
+    auto ok = TrySendFinishSync(sync_id, sent);
     if(!ok) {
         cout << "FinishSync unsuccessful" << endl;
+        fail();
     }
     return ok;
-}
\ No newline at end of file
+}
@@ -3,29 +3,146 @@
 
 #include <grpcpp/grpcpp.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "../cmake/build/blockstorage.grpc.pb.h"
+#include "DirtyBitmap.hh"
+#include "DirtyMapFile.hh"
 using blockstorageproto::BlockStorage;
 #include <mutex>
 #include <shared_mutex>
 
 #include "FileStorage.hh"
+#include "ReplicationChannel.hh"
+#include "WireCompression.hh"
+
+// Dirty blocks carried by one SyncStream frame
+#define SYNC_FRAME_BLOCKS 64
+// Frames read ahead of the one being sent, per stream
+#define SYNC_STREAM_WINDOW 8
+// Concurrent SyncStream calls per sync, each covering one range of addresses (see SyncWorker)
+#define SYNC_WORKERS 4
+// Dirty sets this big are first narrowed down by comparing hash trees with the partner
+#define SYNC_TREE_DIFF_BLOCKS 16384
+// Most hash tree nodes compared per CompareTree call (about 512 KiB of hashes)
+#define COMPARE_TREE_NODES 32768
+// How long a node about to start standalone waits for its partner to answer
+#define PARTNER_CHECK_TIMEOUT_MS 1000
 
 class ReplicationModule {
+   public:
+    // One BackupWriteExtent call: chunks are sent as they come, and the
+    // backup confirms the whole extent on Finish
+    class ExtentSender {
+        bool compress;
+        grpc::ClientContext context;
+        blockstorageproto::Ack res;
+        std::unique_ptr<grpc::ClientWriter<blockstorageproto::ExtentChunk>> writer;
+
+       public:
+        ExtentSender(BlockStorage::Stub *stub, bool compress);
+        bool Send(const blockstorageproto::ExtentChunk &chunk);
+        bool Finish();
+    };
+
+    // One SyncStream call. Its SyncWorker reads dirty blocks into frames
+    // while a writer thread sends the frames before them, so disk reads overlap
+    // the transfer. Up to SYNC_STREAM_WINDOW frames wait to be sent; beyond
+    // that the worker waits, and gRPC's flow control holds the writer
+    // back when the partner falls behind.
+    // If the writer makes no progress for RECOVERY_TIMEOUT_MS, the call is cancelled.
+    class SyncSender {
+        struct Frame {
+            blockstorageproto::SyncFrame msg;
+            grpc::WriteOptions options;
+        };
+
+        grpc::ClientContext context;
+        blockstorageproto::Ack res;
+        std::unique_ptr<grpc::ClientWriter<blockstorageproto::SyncFrame>> writer;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::unique_ptr<Frame>> queued;
+        // Sent frames, kept for their buffers
+        std::vector<std::unique_ptr<Frame>> spare;
+        // Handed out by Next, queued by Send
+        std::unique_ptr<Frame> filling;
+        std::chrono::steady_clock::time_point progress;
+        bool closing = false;
+        bool failed = false;
+        bool finished = false;
+        std::thread thread;
+
+        void RunWriter();
+        void Await(std::unique_lock<std::mutex> &lock, std::function<bool()> ready);
+
+       public:
+        SyncSender(BlockStorage::Stub *stub);
+        ~SyncSender();
+        // An empty frame to fill, once the window has room; nullptr if the call has failed
+        blockstorageproto::SyncFrame *Next();
+        // Queue the frame from Next
+        void Send(grpc::WriteOptions options);
+        // Send what is queued and end the call; true if the partner applied every frame
+        bool Finish();
+    };
+
    private:
-    std::unordered_set<uint64_t> dirtySet;
-    std::vector<uint64_t> dirtyVec;
+    // Blocks changed while the partner was away. Writers mark them
+    // concurrently (holding only the shared state lock).
+    DirtyBitmap dirty_;
+    // Blocks taken from dirty_ by the sync under way, returned to it if the sync fails
+    DirtyBitmap syncing_;
+    // One sync at a time, so a stale sync can't take blocks from under the current one
+    std::mutex syncMutex_;
+    // On-disk copy of dirty_ and syncing_ together, if persisted
+    std::unique_ptr<DirtyMapFile> dirtyFile_;
+    // Held while blocks move from dirty_ to syncing_, so a snapshot sees each in one or the other
+    std::mutex snapshotMutex_;
     std::unique_ptr<BlockStorage::Stub> stub_;
+    std::unique_ptr<ReplicationChannel> channel_;
+    // Whether the channel compresses by default, so payloads that won't shrink should opt out
+    bool compress_;
+
+    // Compare our hashes of these nodes at one level with the partner's,
+    // filling `differing` with those that don't match
+    bool TryCompareTree(HashTree* tree, int level, const std::vector<uint64_t>& nodes, std::vector<uint64_t>* differing);
+    // Cut the dirty set down to the blocks whose hash differs on the partner,
+    // descending only into subtrees that differ. On failure the set is left whole.
+    bool TryNarrowDirty(FileStorage* storage);
    public:
-    ReplicationModule(std::shared_ptr<grpc::Channel> channel);
+    ReplicationModule(std::shared_ptr<grpc::Channel> channel, grpc_compression_algorithm compression = GRPC_COMPRESS_NONE);
 
     void PingOnce();
+    // Ask the partner once, without waiting for it to come up, whether it is serving clients
+    bool PartnerServing();
+    // Keep the dirty blocks in <fileName>.dirty, picking up any left there
+    // unless the volume is fresh. Without one, an existing volume may hold
+    // writes the partner never got, so every block is dirty. Returns whether
+    // the map picked up says this node still owes the partner blocks. Call
+    // before serving requests.
+    bool PersistDirty(const std::string& fileName, bool freshVolume);
+    // Returns once the block is recorded as dirty (on disk, if persisted)
     void MarkDirty(uint64_t address);
+    // Make a write while Standalone. Its blocks are recorded as dirty before
+    // they change, so a restart mid-write still resyncs them, and again after,
+    // in case a sync under way took them before the write landed.
+    void WriteDirty(const std::vector<uint64_t>& addresses, const std::function<void()>& write);
     void ClearDirty();
-    bool TrySendBackupWrite(uint64_t address, const char* buffer);
+    // Non-blocking replication of a single write over the Replicate stream;
+    // `done` runs on the channel's thread with whether the backup has it
+    void SendBackupWriteAsync(uint64_t address, const std::string& data, std::function<void(bool)> done);
+    // Forwards a client's batch as-is; it must stay alive until `done` runs
+    void SendBackupWriteBatchAsync(const blockstorageproto::WriteBatchRequest* batch, std::function<void(bool)> done);
+    std::unique_ptr<ExtentSender> OpenBackupExtent();
     bool TrySendTriggerSync(int sync_id);
-    bool TrySendSyncBlock(int sync_id, uint64_t address, char* buffer);
     bool TrySendFinishSync(int sync_id, size_t block_count);
     bool TryPerformSync(int sync_id, std::unique_lock<std::shared_mutex>* lock, FileStorage* storage);
 };
@@ -0,0 +1,147 @@
+#include "SyncWorker.hh"
+
+#include <algorithm>
+#include <utility>
+
+#include "../shared/CommonDefinitions.hh"
+#include "WireCompression.hh"
+#include "ZeroBlock.hh"
+
+using blockstorageproto::BlockStorage;
+using blockstorageproto::SyncFrame;
+
+SyncWorker::SyncWorker(BlockStorage::Stub *stub, FileStorage *storage, int sync_id, bool compress)
+    : sender(stub), storage(storage), sync_id(sync_id), compress(compress) {
+    thread = std::thread(&SyncWorker::Run, this);
+}
+
+SyncWorker::~SyncWorker() {
+    {
+        std::lock_guard lock(mtx);
+        if (!done) {
+            // Abandoned partway through; the sync will be retried, so don't bother sending the rest
+            pending.clear();
+        }
+        closing = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+bool SyncWorker::Add(uint64_t address) {
+    std::unique_lock lock(mtx);
+    cv.wait(lock, [&] { return failed || pending.size() < SYNC_WORKER_BACKLOG; });
+    if (failed) {
+        return false;
+    }
+    pending.push_back(address);
+    if (pending.size() >= SYNC_FRAME_BLOCKS) {
+        cv.notify_all();
+    }
+    return true;
+}
+
+void SyncWorker::Close() {
+    {
+        std::lock_guard lock(mtx);
+        closing = true;
+    }
+    cv.notify_all();
+}
+
+bool SyncWorker::Finish() {
+    Close();
+    std::unique_lock lock(mtx);
+    cv.wait(lock, [&] { return done; });
+    return !failed;
+}
+
+void SyncWorker::Run() {
+    std::vector<uint64_t> addresses;
+    std::unique_lock lock(mtx);
+    while (true) {
+        // Only short frames once we know no more blocks are coming
+        cv.wait(lock, [&] { return pending.size() >= SYNC_FRAME_BLOCKS || closing; });
+        if (pending.empty()) {
+            break;
+        }
+        auto n = std::min(pending.size(), (size_t)SYNC_FRAME_BLOCKS);
+        addresses.assign(pending.begin(), pending.begin() + n);
+        pending.erase(pending.begin(), pending.begin() + n);
+        lock.unlock();
+        cv.notify_all();
+
+        auto frame = sender.Next();
+        if (frame == nullptr) {
+            lock.lock();
+            failed = true;
+            break;
+        }
+        frame->set_sync_id(sync_id);
+        sender.Send(Fill(frame, addresses));
+        lock.lock();
+    }
+    lock.unlock();
+
+    bool ok = !failed && sender.Finish();
+
+    lock.lock();
+    failed = !ok;
+    done = true;
+    cv.notify_all();
+}
+
+grpc::WriteOptions SyncWorker::Fill(SyncFrame *frame, const std::vector<uint64_t> &addresses) {
+    // Read straight into the frame. Addresses come in order, so runs of
+    // neighbouring blocks are read as one extent each
+    auto blocks = frame->mutable_blocks();
+    std::vector<iovec> run;
+    uint64_t start = 0;
+    for (auto address : addresses) {
+        if (!run.empty() && address != start + run.size() * BLOCK_SIZE) {
+            storage->read_extent(start, run);
+            run.clear();
+        }
+        if (run.empty()) {
+            start = address;
+        }
+        auto write = blocks->add_writes();
+        write->set_address(address);
+        auto data = write->mutable_data();
+        data->resize(BLOCK_SIZE);
+        run.push_back({&(*data)[0], BLOCK_SIZE});
+    }
+    if (!run.empty()) {
+        storage->read_extent(start, run);
+    }
+
+    // Blocks carried in full, and how many of those look compressible
+    int carried = 0;
+    int worth = 0;
+    for (auto &write : *blocks->mutable_writes()) {
+        if (IsZeroBlock(write.data())) {
+            write.clear_data();
+            write.set_zero(true);
+            continue;
+        }
+        auto hash = ContentIndex::Hash(write.data());
+        auto known = content.Find(hash);
+        if (known != nullptr && *known == write.data()) {
+            // Sent earlier on this stream, so the partner has it
+            write.clear_data();
+            write.set_content_hash(hash);
+            continue;
+        }
+        content.Insert(hash, write.data());
+        carried++;
+        if (compress) {
+            worth += WorthCompressing(write.data());
+        }
+    }
+
+    grpc::WriteOptions options;
+    if (compress && worth * 2 < carried) {
+        options.set_no_compression();
+    }
+    return options;
+}
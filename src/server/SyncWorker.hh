@@ -0,0 +1,59 @@
+#ifndef SYNCWORKER_HH
+#define SYNCWORKER_HH
+
+#include <grpcpp/grpcpp.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../cmake/build/blockstorage.grpc.pb.h"
+#include "ContentIndex.hh"
+#include "FileStorage.hh"
+#include "ReplicationModule.hh"
+
+// Dirty blocks a worker may have waiting to be read before the syncing thread waits for it
+#define SYNC_WORKER_BACKLOG (4 * SYNC_FRAME_BLOCKS)
+
+// Sends one address range's share of a sync over its own SyncStream call.
+// The syncing thread hands it dirty addresses, and its thread reads them from
+// storage a frame at a time and queues the frames on its SyncSender, so workers
+// for different ranges read and send in parallel. A block always goes to the
+// same worker, so its frames reach the partner in order.
+class SyncWorker {
+    ReplicationModule::SyncSender sender;
+    FileStorage *storage;
+    int sync_id;
+    bool compress;
+    // Mirrors the partner's index for this stream
+    ContentIndex content;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<uint64_t> pending;
+    bool closing = false;
+    bool failed = false;
+    bool done = false;
+    std::thread thread;
+
+    void Run();
+    // Read blocks into a frame, flagging zeros and blocks already sent on this
+    // stream; returns how the frame should be sent
+    grpc::WriteOptions Fill(blockstorageproto::SyncFrame *frame, const std::vector<uint64_t> &addresses);
+
+   public:
+    SyncWorker(blockstorageproto::BlockStorage::Stub *stub, FileStorage *storage, int sync_id, bool compress);
+    ~SyncWorker();
+
+    // Queue a dirty block; false once this worker's stream has failed
+    bool Add(uint64_t address);
+    // No more blocks are coming; the rest go out without waiting for a full frame
+    void Close();
+    // Close, and wait for the stream to end; true if the partner applied every block
+    bool Finish();
+};
+
+#endif
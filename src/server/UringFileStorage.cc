@@ -0,0 +1,483 @@
+// <linux/io_uring.h> pulls in <linux/fs.h>, whose BLOCK_SIZE (1024) would
+// clash with ours, so it comes before anything of ours and that one is dropped
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+
+#include "UringFileStorage.hh"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+
+#include "../shared/CommonDefinitions.hh"
+
+// user_data tag for the eventfd poll that wakes the ring thread
+#define WAKE_TAG 0
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// A ring can be set up on kernels that predate the ops we use (READ/WRITE
+// arrived in 5.6), and then fails each of them with EINVAL. The probe itself
+// is also 5.6, so a kernel that refuses it lacks them anyway.
+static bool supports_ops(int ring_fd) {
+    size_t len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<char> buf(len, 0);
+    auto probe = reinterpret_cast<io_uring_probe *>(buf.data());
+    if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        return false;
+    }
+    for (unsigned op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_POLL_ADD}) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+    }
+    return true;
+}
+
+UringFileStorage::UringFileStorage(string fileName) : FileStorage(fileName) {
+    available = setup();
+    if (!available) {
+        std::cerr << "io_uring unavailable (" << strerror(errno) << "); using pread/pwrite" << std::endl;
+        teardown();
+        return;
+    }
+    ringThread = std::thread([this] { ring_loop(); });
+}
+
+UringFileStorage::~UringFileStorage() {
+    if (ringThread.joinable()) {
+        {
+            std::lock_guard lock(queueMutex);
+            stopping = true;
+        }
+        wake();
+        ringThread.join();
+    }
+    teardown();
+}
+
+bool UringFileStorage::setup() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = io_uring_setup(URING_ENTRIES, &p);
+    if (ring_fd < 0) return false;
+    if (!supports_ops(ring_fd)) return false;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) return false;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_len = cq_len = std::max(sq_len, cq_len);
+    }
+
+    sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        sq_ptr = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            return false;
+        }
+    }
+    sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    void *s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe *>(s);
+
+    auto sq = static_cast<char *>(sq_ptr);
+    sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+
+    auto cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    return true;
+}
+
+void UringFileStorage::teardown() {
+    if (sqes != nullptr) munmap(sqes, sqes_len);
+    if (cq_ptr != nullptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+    if (sq_ptr != nullptr) munmap(sq_ptr, sq_len);
+    if (wake_fd >= 0) close(wake_fd);
+    if (ring_fd >= 0) close(ring_fd);
+    sqes = nullptr;
+    sq_ptr = cq_ptr = nullptr;
+    wake_fd = ring_fd = -1;
+}
+
+void UringFileStorage::wake() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        std::cerr << "failed to wake io_uring thread: " << strerror(errno) << std::endl;
+    }
+}
+
+void UringFileStorage::enqueue(Op *op) {
+    {
+        std::lock_guard lock(queueMutex);
+        pending.push_back(op);
+    }
+    wake();
+}
+
+// Only the ring thread touches the submission queue, and every entry it fills
+// is handed to the kernel by the next io_uring_enter, so slots never run out
+// as long as fewer than URING_ENTRIES are prepared per pass.
+io_uring_sqe *UringFileStorage::next_sqe() {
+    to_submit++;
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    auto sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+void UringFileStorage::prep_op(Op *op) {
+    auto sqe = next_sqe();
+    sqe->fd = fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    switch (op->kind) {
+        case Op::Read:
+        case Op::Write:
+            sqe->opcode = op->kind == Op::Read ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->off = op->offset + op->done;
+            sqe->addr = reinterpret_cast<uint64_t>(op->buf + op->done);
+            sqe->len = BLOCK_SIZE - op->done;
+            break;
+        case Op::Fsync:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            break;
+    }
+}
+
+void UringFileStorage::arm_wakeup() {
+    auto sqe = next_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = WAKE_TAG;
+}
+
+void UringFileStorage::ring_loop() {
+    std::deque<Op *> retry;
+    size_t in_flight = 0;
+
+    arm_wakeup();
+
+    while (true) {
+        // Leave room for re-arming the wakeup poll
+        size_t capacity = URING_ENTRIES - 2 - in_flight;
+        std::vector<Op *> batch_ops;
+        {
+            std::lock_guard lock(queueMutex);
+            if (stopping && pending.empty() && retry.empty() && in_flight == 0) break;
+            while (!retry.empty() && batch_ops.size() < capacity) {
+                batch_ops.push_back(retry.front());
+                retry.pop_front();
+            }
+            while (!pending.empty() && batch_ops.size() < capacity) {
+                batch_ops.push_back(pending.front());
+                pending.pop_front();
+            }
+        }
+
+        // New writes in this pass share one batch; its fsync is issued once
+        // the last of them has completed
+        Batch *batch = nullptr;
+        for (auto op : batch_ops) {
+            prep_op(op);
+            if (op->kind == Op::Write && op->batch == nullptr) {
+                if (batch == nullptr) batch = new Batch();
+                batch->writes.push_back(op);
+                batch->outstanding++;
+                op->batch = batch;
+            }
+        }
+        in_flight += batch_ops.size();
+
+        // Submit the whole batch and wait for at least one completion
+        // (an I/O, or the wakeup poll firing because more work was queued)
+        int r = io_uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (r < 0) {
+            if (errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            }
+        } else {
+            to_submit -= r;
+        }
+
+        in_flight -= reap(retry);
+    }
+}
+
+size_t UringFileStorage::reap(std::deque<Op *> &retry) {
+    size_t completed = 0;
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        auto cqe = &cqes[head & *cq_mask];
+        auto res = cqe->res;
+        auto tag = cqe->user_data;
+        head++;
+
+        if (tag == WAKE_TAG) {
+            uint64_t count;
+            while (read(wake_fd, &count, sizeof(count)) > 0) {
+            }
+            arm_wakeup();
+            // The re-armed poll goes out with the next submission
+            continue;
+        }
+
+        completed++;
+        auto op = reinterpret_cast<Op *>(tag);
+        switch (op->kind) {
+            case Op::Read:
+            case Op::Write:
+                if (res < 0) {
+                    op->ok = false;
+                } else if (res == 0 && op->kind == Op::Read) {
+                    // Past the end of the file; unwritten space reads as zeros
+                    memset(op->buf + op->done, 0, BLOCK_SIZE - op->done);
+                    op->done = BLOCK_SIZE;
+                } else {
+                    op->done += res;
+                }
+
+                if (op->ok && op->done < BLOCK_SIZE) {
+                    // Short transfer: resubmit the remainder
+                    retry.push_back(op);
+                } else if (op->kind == Op::Read) {
+                    op->callback(op->ok);
+                    delete op;
+                } else {
+                    // Writes complete when their batch's fsync does
+                    write_finished(op, retry);
+                }
+                break;
+            case Op::Fsync: {
+                for (auto w : op->batch->writes) {
+                    w->callback(w->ok && res >= 0);
+                    delete w;
+                }
+                delete op->batch;
+                delete op;
+                break;
+            }
+        }
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return completed;
+}
+
+void UringFileStorage::write_finished(Op *op, std::deque<Op *> &retry) {
+    auto batch = op->batch;
+    if (--batch->outstanding > 0) return;
+
+    bool any_ok = false;
+    for (auto w : batch->writes) any_ok |= w->ok;
+    if (!any_ok) {
+        for (auto w : batch->writes) {
+            w->callback(false);
+            delete w;
+        }
+        delete batch;
+        return;
+    }
+
+    auto sync = new Op();
+    sync->kind = Op::Fsync;
+    sync->batch = batch;
+    retry.push_back(sync);
+}
+
+void UringFileStorage::submit_read(uint64_t offset, char *out, std::function<void(bool)> done) {
+    auto op = new Op();
+    op->kind = Op::Read;
+    op->offset = offset;
+    op->buf = out;
+    op->callback = std::move(done);
+    enqueue(op);
+}
+
+void UringFileStorage::submit_write(uint64_t offset, const char *in, std::function<void(bool)> done) {
+    auto op = new Op();
+    op->kind = Op::Write;
+    op->offset = offset;
+    op->buf = const_cast<char *>(in);
+    op->callback = std::move(done);
+    enqueue(op);
+}
+
+void UringFileStorage::write_data(uint64_t offset, const char *in) {
+    if (!available) {
+        FileStorage::write_data(offset, in);
+        return;
+    }
+
+    BlockLockTable::WriteGuard guard(locks, offset);
+    std::promise<bool> result;
+    submit_write(offset, in, [&result](bool ok) { result.set_value(ok); });
+    if (!result.get_future().get()) {
+        throw std::runtime_error("io_uring write failed");
+    }
+    if (cache) {
+        cache->update(offset, in);
+    }
+    if (tree) {
+        tree->invalidate(offset);
+    }
+}
+
+void UringFileStorage::read_data(uint64_t offset, char *out) {
+    if (!available) {
+        FileStorage::read_data(offset, out);
+        return;
+    }
+
+    BlockLockTable::ReadGuard guard(locks, offset);
+    if (cache && cache->lookup(offset, out)) {
+        return;
+    }
+    std::promise<bool> result;
+    submit_read(offset, out, [&result](bool ok) { result.set_value(ok); });
+    if (!result.get_future().get()) {
+        throw std::runtime_error("io_uring read failed");
+    }
+    if (cache) {
+        cache->insert(offset, out);
+    }
+}
+
+// Counts down completions of a group of ops submitted together
+struct UringFileStorage::Pending {
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t remaining = 0;
+    bool ok = true;
+
+    // Completions of ops already submitted may be counting down meanwhile
+    std::function<void(bool)> callback() {
+        std::lock_guard lock(mtx);
+        remaining++;
+        return [this](bool success) {
+            std::lock_guard lock(mtx);
+            ok &= success;
+            if (--remaining == 0) cv.notify_all();
+        };
+    }
+
+    bool wait() {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [this] { return remaining == 0; });
+        return ok;
+    }
+};
+
+void UringFileStorage::write_batch(const std::vector<std::pair<uint64_t, const char *>> &blocks) {
+    if (!available) {
+        FileStorage::write_batch(blocks);
+        return;
+    }
+
+    std::vector<uint64_t> offsets;
+    for (auto &block : blocks) offsets.push_back(block.first);
+
+    // Writes in flight together complete in any order, which is only safe if none overlap
+    auto sorted = offsets;
+    std::sort(sorted.begin(), sorted.end());
+    bool overlapping = false;
+    for (size_t i = 1; i < sorted.size(); i++) {
+        overlapping |= sorted[i] - sorted[i - 1] < BLOCK_SIZE;
+    }
+
+    BlockLockTable::BatchGuard guard(locks, offsets, false);
+    bool ok = true;
+    if (overlapping) {
+        for (auto &block : blocks) {
+            Pending pending;
+            submit_write(block.first, block.second, pending.callback());
+            ok &= pending.wait();
+        }
+    } else {
+        // Submitted together, the writes share a ring pass and its fsync
+        Pending pending;
+        for (auto &block : blocks) {
+            submit_write(block.first, block.second, pending.callback());
+        }
+        ok = pending.wait();
+    }
+    if (!ok) {
+        throw std::runtime_error("io_uring write failed");
+    }
+    if (cache) {
+        for (auto &block : blocks) cache->update(block.first, block.second);
+    }
+    if (tree) {
+        for (auto &block : blocks) tree->invalidate(block.first);
+    }
+}
+
+void UringFileStorage::read_batch(const std::vector<std::pair<uint64_t, char *>> &blocks) {
+    if (!available) {
+        FileStorage::read_batch(blocks);
+        return;
+    }
+
+    std::vector<uint64_t> offsets;
+    for (auto &block : blocks) offsets.push_back(block.first);
+
+    BlockLockTable::BatchGuard guard(locks, offsets, true);
+    Pending pending;
+    std::vector<std::pair<uint64_t, char *>> misses;
+    for (auto &block : blocks) {
+        if (cache && cache->lookup(block.first, block.second)) {
+            continue;
+        }
+        misses.push_back(block);
+        submit_read(block.first, block.second, pending.callback());
+    }
+    if (!pending.wait()) {
+        throw std::runtime_error("io_uring read failed");
+    }
+    if (cache) {
+        for (auto &block : misses) cache->insert(block.first, block.second);
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef URINGFILESTORAGE_HH
+#define URINGFILESTORAGE_HH
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FileStorage.hh"
+
+using std::string;
+
+// From <linux/io_uring.h>, which only the .cc includes (see there)
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Submission queue depth; also the cap on I/Os in flight at once
+#define URING_ENTRIES 256
+
+// FileStorage backend that drives block I/O through io_uring.
+// Callers queue ops from any thread; a single ring thread submits everything
+// queued since its last pass in one io_uring_enter and invokes each op's
+// callback as its completion is reaped. Writes submitted together form a batch
+// that is covered by one fdatasync once they have all landed, so a write
+// completes only once durable.
+//
+// The FileStorage calls take their block locks, queue their ops and wait for
+// the callbacks, so the calling thread is parked while they are in flight but
+// every thread's ops share the ring's passes and fsyncs. The callbacks stay
+// internal: a block lock is owned by the thread that took it, so it cannot be
+// held from submission until a completion on the ring thread.
+//
+// If the kernel refuses io_uring, or lacks the read/write/fsync ops, falls back to
+// pread/pwrite.
+class UringFileStorage : public FileStorage {
+    struct Batch;
+
+    struct Op {
+        enum Kind { Read, Write, Fsync } kind;
+        uint64_t offset = 0;
+        char *buf = nullptr;
+        size_t done = 0;
+        std::function<void(bool)> callback;
+        Batch *batch = nullptr;
+        bool ok = true;
+    };
+
+    // Writes covered by one trailing fdatasync
+    struct Batch {
+        std::vector<Op *> writes;
+        size_t outstanding = 0;
+    };
+
+    bool available = false;
+    int ring_fd = -1;
+    int wake_fd = -1;
+
+    // Ring memory shared with the kernel
+    void *sq_ptr = nullptr;
+    void *cq_ptr = nullptr;
+    size_t sq_len = 0;
+    size_t cq_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_len = 0;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    // Entries prepared but not yet handed to the kernel
+    unsigned to_submit = 0;
+
+    std::mutex queueMutex;
+    std::deque<Op *> pending;
+    bool stopping = false;
+    std::thread ringThread;
+
+    struct Pending;
+
+    bool setup();
+    void teardown();
+    void enqueue(Op *op);
+    void wake();
+    io_uring_sqe *next_sqe();
+    void prep_op(Op *op);
+    void arm_wakeup();
+    void ring_loop();
+    size_t reap(std::deque<Op *> &retry);
+    void write_finished(Op *op, std::deque<Op *> &retry);
+
+    // Queue an op; `done` runs on the ring thread once it completes
+    void submit_read(uint64_t offset, char *out, std::function<void(bool)> done);
+    void submit_write(uint64_t offset, const char *in, std::function<void(bool)> done);
+
+   public:
+    UringFileStorage(string fileName);
+    virtual ~UringFileStorage();
+
+    virtual void write_data(uint64_t offset, const char *in) override;
+    virtual void read_data(uint64_t offset, char *out) override;
+    virtual void write_batch(const std::vector<std::pair<uint64_t, const char *>> &blocks) override;
+    virtual void read_batch(const std::vector<std::pair<uint64_t, char *>> &blocks) override;
+};
+
+#endif
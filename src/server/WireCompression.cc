@@ -0,0 +1,46 @@
+#include "WireCompression.hh"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Samples are taken in runs of this many bytes, so repeats within a run still count
+#define COMPRESSION_PROBE_RUN 64
+
+grpc_compression_algorithm ParseCompression(const std::string &name) {
+    if (name == "none") return GRPC_COMPRESS_NONE;
+    if (name == "deflate") return GRPC_COMPRESS_DEFLATE;
+    if (name == "gzip") return GRPC_COMPRESS_GZIP;
+    throw std::runtime_error("Unknown compression algorithm " + name);
+}
+
+bool WorthCompressing(const std::string &data) {
+    if (data.empty()) {
+        return false;
+    }
+
+    // Spread the runs evenly, so a large payload is judged by all of it
+    uint32_t counts[256] = {};
+    size_t runs = (std::min(data.size(), (size_t)COMPRESSION_PROBE_BYTES) + COMPRESSION_PROBE_RUN - 1) / COMPRESSION_PROBE_RUN;
+    size_t stride = data.size() / runs;
+    size_t sampled = 0;
+    for (size_t r = 0; r < runs; r++) {
+        auto run = data.data() + r * stride;
+        auto len = std::min((size_t)COMPRESSION_PROBE_RUN, data.size() - r * stride);
+        for (size_t i = 0; i < len; i++) {
+            counts[(uint8_t)run[i]]++;
+        }
+        sampled += len;
+    }
+
+    double entropy = 0;
+    for (auto count : counts) {
+        if (count > 0) {
+            double p = (double)count / sampled;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy <= COMPRESSION_MAX_ENTROPY;
+}
@@ -0,0 +1,28 @@
+#ifndef WIRECOMPRESSION_HH
+#define WIRECOMPRESSION_HH
+
+#include <grpc/compression.h>
+#include <stddef.h>
+
+#include <string>
+
+// Bytes of a payload looked at to decide whether it is worth compressing
+#define COMPRESSION_PROBE_BYTES 4096
+// Payloads whose sampled byte entropy is above this (in bits per byte) go out uncompressed
+#define COMPRESSION_MAX_ENTROPY 7.0
+
+// Compression of replication and resync traffic rides on gRPC message
+// compression: the partner channel is created with a default algorithm, and
+// the receiving server, which accepts every algorithm gRPC supports, inflates
+// messages before our handlers see them. Messages that would not get smaller
+// are skipped, either by us (see WorthCompressing) or by gRPC itself.
+
+// Maps a --compression value ("none", "deflate" or "gzip") to its algorithm; throws on anything else
+grpc_compression_algorithm ParseCompression(const std::string &name);
+
+// Cheap guess at whether deflating a payload would pay off, from the byte
+// entropy of a sample of it. Already-compressed or encrypted blocks fail it,
+// so we don't burn CPU deflating them for nothing.
+bool WorthCompressing(const std::string &data);
+
+#endif
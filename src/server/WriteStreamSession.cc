@@ -0,0 +1,125 @@
+#include "WriteStreamSession.hh"
+
+#include <exception>
+#include <thread>
+
+using blockstorageproto::StreamAck;
+using blockstorageproto::StreamWrite;
+using grpc::ServerReaderWriter;
+
+WriteStreamSession::WriteStreamSession(PairedServer *server, ServerContext *context, ServerReaderWriter<StreamAck, StreamWrite> *stream)
+    : server(server), context(context), stream(stream) {}
+
+// A write at `address` covers one block, or two when unaligned
+bool WriteStreamSession::Overlaps(uint64_t address) {
+    return busy.count(address / BLOCK_SIZE) || busy.count((address + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+void WriteStreamSession::Track(uint64_t address, int delta) {
+    auto first = address / BLOCK_SIZE;
+    auto last = (address + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (auto block = first; block <= last; block++) {
+        if ((busy[block] += delta) == 0) {
+            busy.erase(block);
+        }
+    }
+}
+
+Status WriteStreamSession::Run() {
+    std::thread acker(&WriteStreamSession::SendAcks, this);
+
+    StreamWrite write;
+    while (stream->Read(&write)) {
+        Pending *pending;
+        {
+            std::unique_lock lock(mtx);
+            slotFree.wait(lock, [&] { return inflight < WRITE_STREAM_WINDOW && !Overlaps(write.address()); });
+            inflight++;
+            Track(write.address(), 1);
+            if (spare.empty()) {
+                pending = new Pending;
+            } else {
+                pending = spare.back();
+                spare.pop_back();
+            }
+        }
+
+        pending->seq = write.seq();
+        pending->req.set_address(write.address());
+        // The next message is parsed into the buffer this one gives up
+        pending->req.mutable_data()->swap(*write.mutable_data());
+
+        // May complete here, or later on whichever thread finishes the replication.
+        // A write that throws never completes, so fail it here rather than
+        // unwinding past the acker.
+        try {
+            server->WriteAsync(context, &pending->req, &pending->res, [this, pending](Status status) { Complete(pending, status); });
+        } catch (const std::exception &e) {
+            Complete(pending, Status(grpc::StatusCode::INTERNAL, e.what()));
+        }
+    }
+
+    // The client is done sending (or gone); the completions still refer to us
+    {
+        std::unique_lock lock(mtx);
+        slotFree.wait(lock, [&] { return inflight == 0; });
+        closing = true;
+    }
+    ackReady.notify_one();
+    acker.join();
+    for (auto pending : spare) {
+        delete pending;
+    }
+    return Status::OK;
+}
+
+void WriteStreamSession::Complete(Pending *pending, Status status) {
+    // Notify before unlocking: once the last write is counted out, Run() may
+    // return and the session go away as soon as the lock is free
+    std::lock_guard lock(mtx);
+    inflight--;
+    Track(pending->req.address(), -1);
+    acks.emplace_back(pending->seq, status);
+    spare.push_back(pending);
+    slotFree.notify_one();
+    ackReady.notify_one();
+}
+
+void WriteStreamSession::SendAcks() {
+    std::vector<std::pair<uint64_t, Status>> ready;
+    bool connected = true;
+
+    while (true) {
+        {
+            std::unique_lock lock(mtx);
+            ackReady.wait(lock, [&] { return !acks.empty() || closing; });
+            if (acks.empty()) {
+                return;
+            }
+            ready.swap(acks);
+        }
+        if (!connected) {
+            // Keep draining so the session can finish
+            ready.clear();
+            continue;
+        }
+
+        // Successes share one message; each failure gets its own
+        StreamAck ok;
+        for (auto &[seq, status] : ready) {
+            if (status.ok()) {
+                ok.add_seq(seq);
+                continue;
+            }
+            StreamAck failed;
+            failed.add_seq(seq);
+            failed.set_code(status.error_code());
+            failed.set_message(status.error_message());
+            connected = connected && stream->Write(failed);
+        }
+        if (ok.seq_size() > 0) {
+            connected = connected && stream->Write(ok);
+        }
+        ready.clear();
+    }
+}
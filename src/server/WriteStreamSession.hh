@@ -0,0 +1,63 @@
+#ifndef WRITESTREAMSESSION_HH
+#define WRITESTREAMSESSION_HH
+
+#include <grpcpp/grpcpp.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../cmake/build/blockstorage.grpc.pb.h"
+#include "PairedServer.hh"
+
+// Writes a single stream may have in flight before we stop reading from it
+#define WRITE_STREAM_WINDOW 128
+
+// Serves one WriteStream call. The handler thread reads writes off the stream
+// and starts each through PairedServer::WriteAsync without waiting for the
+// previous one, so a client can keep a deep pipeline going over one call.
+// Acks go out on a separate thread as writes complete, in whatever order that
+// is. Completions that pile up meanwhile share one message.
+// A write that touches a block with an earlier write still in flight waits
+// for it, so overlapping writes land (locally and on the backup) in stream order.
+class WriteStreamSession {
+    struct Pending {
+        uint64_t seq;
+        WriteRequest req;
+        WriteResponse res;
+    };
+
+    PairedServer *server;
+    ServerContext *context;
+    grpc::ServerReaderWriter<blockstorageproto::StreamAck, blockstorageproto::StreamWrite> *stream;
+
+    std::mutex mtx;
+    // Signalled when a write completes, freeing a slot and maybe some blocks
+    std::condition_variable slotFree;
+    // Signalled when an ack is queued or the session is closing
+    std::condition_variable ackReady;
+    size_t inflight = 0;
+    // In-flight writes touching each block index
+    std::unordered_map<uint64_t, int> busy;
+    // Completed writes that have not been acked yet
+    std::vector<std::pair<uint64_t, Status>> acks;
+    // Finished writes, kept with their buffers for the ones still to come
+    std::vector<Pending *> spare;
+    bool closing = false;
+
+    bool Overlaps(uint64_t address);
+    void Track(uint64_t address, int delta);
+    void Complete(Pending *pending, Status status);
+    void SendAcks();
+
+   public:
+    WriteStreamSession(PairedServer *server, ServerContext *context, grpc::ServerReaderWriter<blockstorageproto::StreamAck, blockstorageproto::StreamWrite> *stream);
+
+    // Returns after the client has finished sending and every write has been acked
+    Status Run();
+};
+
+#endif
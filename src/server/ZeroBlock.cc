@@ -0,0 +1,32 @@
+#include "ZeroBlock.hh"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../shared/CommonDefinitions.hh"
+
+bool IsZeroBlock(const char *data, size_t size) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        uint64_t words[8];
+        memcpy(words, data + i, sizeof(words));
+        uint64_t any = 0;
+        for (auto word : words) {
+            any |= word;
+        }
+        if (any != 0) {
+            return false;
+        }
+    }
+    for (; i < size; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const std::string &ZeroBlock() {
+    static const std::string zeros(BLOCK_SIZE, '\0');
+    return zeros;
+}
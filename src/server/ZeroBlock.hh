@@ -0,0 +1,20 @@
+#ifndef ZEROBLOCK_HH
+#define ZEROBLOCK_HH
+
+#include <stddef.h>
+
+#include <string>
+
+// Blocks of zeros (never written, or explicitly zeroed) are common on sparse
+// volumes. Reads, replication and sync flag them instead of sending 4 KiB of
+// zeros, and the receiver substitutes ZeroBlock() for the missing data.
+
+// Whether every byte is zero. Scans a 64-byte chunk at a time, which compiles
+// to vector loads, and stops at the first chunk holding anything else.
+bool IsZeroBlock(const char *data, size_t size);
+inline bool IsZeroBlock(const std::string &data) { return IsZeroBlock(data.data(), data.size()); }
+
+// A block's worth of zeros, shared by everyone
+const std::string &ZeroBlock();
+
+#endif
@@ -1,7 +1,11 @@
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
+#include <signal.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <exception>
 #include <filesystem>
 #include <fstream>
@@ -13,12 +17,16 @@
 #include <thread>
 
 #include "../shared/CommonDefinitions.hh"
+#include "AsyncServer.hh"
 #include "PrimaryServer.hh"
 #include "BackupServer.hh"
 #include "PairedServer.hh"
 #include "HeartbeatHelper.hh"
 #include "FileStorage.hh"
+#include "MmapFileStorage.hh"
+#include "UringFileStorage.hh"
 #include "ReplicationModule.hh"
+#include "WireCompression.hh"
 #include "../cmake/build/blockstorage.grpc.pb.h"
 
 namespace fs = std::filesystem;
@@ -32,20 +40,18 @@ using std::cout;
 using std::endl;
 using std::string;
 
-void RunServer(PairedServer* service, string port) {
+void RunServer(PairedServer* service, string port, size_t queues, size_t handlers) {
     string server_address = "0.0.0.0:" + port;
 
     // GRPC boilerplate
     grpc::EnableDefaultHealthCheckService(true);
     grpc::reflection::InitProtoReflectionServerBuilderPlugin();
     
-    ServerBuilder builder;
-    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    builder.RegisterService(service);
-    std::unique_ptr<Server> server(builder.BuildAndStart());
+    // Serve RPCs from completion queues, one pinned poller per queue
+    AsyncServer server(service, queues, handlers);
+    server.Start(server_address);
     
-    
-    std::cout << "Server listening on " << server_address << std::endl;
+    std::cout << "Server listening on " << server_address << " (" << server.queue_count() << " completion queues)" << std::endl;
     
     if(service->SafeGetState() == ReplState::Recovering) {
         // Start recovery task on new thread
@@ -53,19 +59,99 @@ void RunServer(PairedServer* service, string port) {
     }
     
     // Block until shutdown
-    server->Wait();
+    server.Wait();
+}
+
+// Record a clean shutdown on SIGINT/SIGTERM, so the next start can trust the volume.
+// FileStorage::shutdown waits out in-flight block ops and holds off any new ones until we exit.
+void HandleShutdownSignals(FileStorage* storage, sigset_t signals) {
+    int sig;
+    sigwait(&signals, &sig);
+    cout << "Shutting down" << endl;
+    if (storage->get_cache() != nullptr) {
+        cout << "Block cache: " << storage->get_cache()->hits() << " hits, " << storage->get_cache()->misses() << " misses" << endl;
+    }
+    storage->shutdown();
+    _exit(0);
+}
+
+void ReportCacheStats(BlockCache* cache) {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(CACHE_REPORT_INTERVAL_S));
+        auto hits = cache->hits();
+        auto misses = cache->misses();
+        cout << "Block cache: " << hits << " hits, " << misses << " misses";
+        if (hits + misses > 0) {
+            cout << " (" << (100 * hits / (hits + misses)) << "% hit rate)";
+        }
+        cout << endl;
+    }
 }
 
 string argErrString(string name) {
-    return "Usage: " + name + " <port> ( primary --backup-address <backup-address> | backup --primary-address <primary-address> ) <storage_file> [--recover]";
+    return "Usage: " + name + " <port> ( primary --backup-address <backup-address> | backup --primary-address <primary-address> ) <storage_file> [--recover]"
+        + " [--storage-engine ( pread | mmap | uring )] [--msync ( write | batch | periodic )] [--direct-io]"
+        + " [--commit-batch <writes>] [--commit-wait-us <us>] [--journal] [--punch-zero-blocks] [--cache-mb <MB>] [--completion-queues <n>]"
+        + " [--compression ( none | deflate | gzip )] [--hash-tree]";
+}
+
+// Storage backend factory
+FileStorage* MakeStorage(string name, string engine, string msync, bool direct, bool journal, bool punch, int cache_mb, string fname_storage) {
+    if (engine == "pread") {
+        auto storage = new FileStorage(fname_storage, direct);
+        if (journal) storage->enable_journal();
+        if (punch) storage->enable_hole_punching();
+        if (cache_mb > 0) storage->enable_cache((size_t)cache_mb * 1024 * 1024);
+        return storage;
+    }
+    if (direct || journal || punch) {
+        // O_DIRECT, journaling and hole punching are only supported by the pread/pwrite engine
+        throw std::runtime_error(argErrString(name));
+    }
+    if (engine == "uring") {
+        auto storage = new UringFileStorage(fname_storage);
+        if (cache_mb > 0) storage->enable_cache((size_t)cache_mb * 1024 * 1024);
+        return storage;
+    }
+    if (cache_mb > 0) {
+        // The mmap engine already reads from the page cache
+        throw std::runtime_error(argErrString(name));
+    }
+    if (engine == "mmap") {
+        if (msync == "write") return new MmapFileStorage(fname_storage, MsyncPolicy::PerWrite);
+        if (msync == "batch") return new MmapFileStorage(fname_storage, MsyncPolicy::Batch);
+        if (msync == "periodic") return new MmapFileStorage(fname_storage, MsyncPolicy::Periodic);
+    }
+    throw std::runtime_error(argErrString(name));
 }
 
 // Polymorphic server factory
-PairedServer* MakeServer(string name, bool recovering, string kind, FileStorage* storage, std::shared_ptr<grpc::Channel> partnerChannel) {
-    auto replication = new ReplicationModule(partnerChannel);
+PairedServer* MakeServer(string name, bool recovering, string kind, FileStorage* storage, string fname_storage, std::shared_ptr<grpc::Channel> partnerChannel, grpc_compression_algorithm compression) {
+    auto replication = new ReplicationModule(partnerChannel, compression);
+    // Remember what the partner is owed across our own restarts
+    bool owed = replication->PersistDirty(fname_storage, storage->was_formatted());
+    if (owed) {
+        // We went down while Standalone. Recovering would have the partner's
+        // sync overwrite what we owe it, so carry on Standalone and send it
+        // when the partner recovers from us.
+        cout << "Resuming as standalone; the partner must recover from this node" << endl;
+    }
+    if (owed || (kind == "primary" && !recovering)) {
+        // About to serve clients alone; if the partner already is, we would both take writes and diverge
+        if (replication->PartnerServing()) {
+            cout << "Assumption violated: starting standalone while the other server is serving clients." << endl;
+            cout << "Stop that server and start this one again, then restart that one so it recovers from this one." << endl;
+            exit(1);
+        }
+    }
     if(kind == "primary") {
         // Initialize the primary in Standalone mode, unless we're recovering
-        return new PrimaryServer(recovering ? ReplState::Recovering : ReplState::Standalone,storage,replication);
+        return new PrimaryServer(recovering && !owed ? ReplState::Recovering : ReplState::Standalone,storage,replication);
+    }
+    if (kind == "backup" && owed) {
+        // The primary is down or will restart with --recover; either way,
+        // serve clients meanwhile rather than waiting for it
+        return new BackupServer(ReplState::Standalone,storage,replication,new HeartbeatHelper(partnerChannel));
     }
     if (kind == "backup") {
         // Wait for the primary to come online before starting the backup
@@ -82,7 +168,7 @@ PairedServer* MakeServer(string name, bool recovering, string kind, FileStorage*
 int main(int argc, char **argv) {
     string name = argv[0];
 
-    if (argc != 6 && argc != 7) {
+    if (argc < 6) {
         cout << argErrString(name) << endl;
         return 1;
     }
@@ -104,25 +190,82 @@ int main(int argc, char **argv) {
     auto is_standalone = string(argv[2]) == "standalone";
 
     bool is_recover = false;
-    if(argc > 6) {
-        if(string(argv[6]) != "--recover") {
+    string engine = "pread";
+    string msync = "write";
+    bool direct = false;
+    bool journal = false;
+    bool punch = false;
+    bool hash_tree = false;
+    int cache_mb = 0;
+    int commit_batch = GROUP_COMMIT_MAX_BATCH;
+    int commit_wait_us = GROUP_COMMIT_MAX_WAIT_US;
+    int queues = 0;  // One per core
+    string compression = "none";
+    for (int i = 6; i < argc; i++) {
+        string flag = argv[i];
+        if (flag == "--recover") {
+            is_recover = true;
+        } else if (flag == "--storage-engine" && i + 1 < argc) {
+            engine = argv[++i];
+        } else if (flag == "--msync" && i + 1 < argc) {
+            msync = argv[++i];
+        } else if (flag == "--direct-io") {
+            direct = true;
+        } else if (flag == "--journal") {
+            journal = true;
+        } else if (flag == "--punch-zero-blocks") {
+            punch = true;
+        } else if (flag == "--cache-mb" && i + 1 < argc) {
+            cache_mb = std::stoi(argv[++i]);
+        } else if (flag == "--commit-batch" && i + 1 < argc) {
+            commit_batch = std::stoi(argv[++i]);
+        } else if (flag == "--commit-wait-us" && i + 1 < argc) {
+            commit_wait_us = std::stoi(argv[++i]);
+        } else if (flag == "--completion-queues" && i + 1 < argc) {
+            queues = std::stoi(argv[++i]);
+        } else if (flag == "--compression" && i + 1 < argc) {
+            compression = argv[++i];
+        } else if (flag == "--hash-tree") {
+            hash_tree = true;
+        } else {
             cout << argErrString(name) << endl;
             return 1;
         }
-        is_recover = true;
     }
     
+    // Route shutdown signals to a dedicated thread; block them before any threads are created
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
     auto fname_storage = fs::weakly_canonical(string(argv[5]));
-    cout << "Using storage file " << fname_storage << endl;
+    cout << "Using storage file " << fname_storage << " (" << engine << " engine)" << endl;
 
-    auto storage = FileStorage(fname_storage);
-    storage.init(STORAGE_FILE_SIZE_MB);
+    auto storage = MakeStorage(name, engine, msync, direct, journal, punch, cache_mb, fname_storage);
+    storage->configure_commit(commit_batch, commit_wait_us);
+    storage->init(STORAGE_FILE_SIZE_MB);
+    if (hash_tree) {
+        // Hash the volume in the background, ready to compare with the partner's (see CompareTree)
+        storage->enable_hash_tree();
+        std::thread([storage] { storage->refresh_hash_tree(); }).detach();
+    }
+    std::thread([storage, signals] { HandleShutdownSignals(storage, signals); }).detach();
+    if (storage->get_cache() != nullptr) {
+        std::thread([storage] { ReportCacheStats(storage->get_cache()); }).detach();
+    }
     
-    // Construct channel to other server
-    auto partnerChannel = grpc::CreateChannel(target, grpc::InsecureChannelCredentials());
+    // Construct channel to other server. Everything we send over it is compressed
+    // with the chosen algorithm, unless the payload won't shrink.
+    grpc::ChannelArguments channelArgs;
+    auto algorithm = ParseCompression(compression);
+    channelArgs.SetCompressionAlgorithm(algorithm);
+    auto partnerChannel = grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), channelArgs);
     
-    auto server = MakeServer(name,is_recover,kind,&storage,partnerChannel);
+    auto server = MakeServer(name,is_recover,kind,storage,fname_storage,partnerChannel,algorithm);
 
-    RunServer(server,port);
+    // Enough handler threads that a full commit batch can wait on one fdatasync
+    RunServer(server,port,queues,std::max(ASYNC_HANDLER_THREADS, commit_batch));
     return 0;
 }